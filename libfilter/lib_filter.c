@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "lib_filter.h"
 #include "lf_protocol.h"
@@ -28,6 +29,9 @@
 
 struct ohandle {
   GHashTable *attributes;
+
+  // monotonic deadline in seconds; 0 if not yet requested, -1 if none
+  double deadline;
 };
 
 struct attribute {
@@ -187,6 +191,38 @@ int lf_omit_attr(lf_obj_handle_t ohandle, const char *name) {
   return lf_get_boolean(lf_state.in) ? 0 : ENOENT;
 }
 
+static double monotonic_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+bool lf_deadline_exceeded(lf_obj_handle_t obj) {
+  struct ohandle *ohandle = obj;
+
+  // ask the server for the remaining budget on the first call only
+  if (ohandle->deadline == 0) {
+    lf_start_output();
+    lf_send_tag(lf_state.out, "get-deadline");
+    lf_end_output();
+
+    char *remaining = lf_get_string(lf_state.in);
+    if (remaining == NULL) {
+      // no budget
+      ohandle->deadline = -1;
+    } else {
+      ohandle->deadline = monotonic_seconds() +
+        g_ascii_strtod(remaining, NULL);
+      g_free(remaining);
+    }
+  }
+
+  if (ohandle->deadline < 0) {
+    return false;
+  }
+  return monotonic_seconds() >= ohandle->deadline;
+}
+
 int lf_get_session_variables(lf_obj_handle_t ohandle,
 			     lf_session_variable_t **list) {
   lf_start_output();
@@ -41,6 +41,7 @@
 
 
 #include <sys/types.h>		/* for size_t */
+#include <stdbool.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -349,6 +350,26 @@ int lf_omit_attr(lf_obj_handle_t ohandle, const char *name);
 diamond_public
 void lf_log(int level, const char *fmt, ...);
 
+/*!
+ * This function reports whether the filter has used up its time budget
+ * for the object.  Filters doing expensive work (e.g. on very large
+ * images) should poll it and return a result early, since the server
+ * kills filters which keep working long after the budget has passed.
+ * Only the first call for an object involves the server.
+ *
+ * \param ohandle
+ *		the object handle.
+ *
+ * \return true
+ *		The time budget for this object has been exceeded.
+ *
+ * \return false
+ *		There is time left, or the server sets no budget.
+ */
+
+diamond_public
+bool lf_deadline_exceeded(lf_obj_handle_t ohandle);
+
 /* anomaly detection */
 typedef struct {
   char *name;
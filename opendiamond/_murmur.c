@@ -0,0 +1,160 @@
+/*
+ *  The OpenDiamond Platform for Interactive Search
+ *
+ *  Copyright (c) 2011 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  This software is distributed under the terms of the Eclipse Public
+ *  License, Version 1.0 which can be found in the file named LICENSE.
+ *  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+ *  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+ */
+
+/*
+ * MurmurHash3_x64_128 for opendiamond.helpers.murmur().  MurmurHash3 was
+ * written by Austin Appleby and placed in the public domain.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Release the GIL while hashing buffers at least this large */
+#define NOGIL_THRESHOLD (64 << 10)
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t getblock64(const uint8_t *p, Py_ssize_t i)
+{
+    uint64_t k;
+
+    /* Unaligned-safe; the hash is defined on little-endian input */
+    memcpy(&k, p + i * 8, sizeof(k));
+#if PY_BIG_ENDIAN
+    k = __builtin_bswap64(k);
+#endif
+    return k;
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static void murmur3_x64_128(const void *key, Py_ssize_t len, uint32_t seed,
+                            uint64_t out[2])
+{
+    const uint8_t *data = key;
+    const Py_ssize_t nblocks = len / 16;
+    const uint8_t *tail = data + nblocks * 16;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = seed;
+    uint64_t h2 = seed;
+    uint64_t k1, k2;
+    Py_ssize_t i;
+
+    for (i = 0; i < nblocks; i++) {
+        k1 = getblock64(data, i * 2);
+        k2 = getblock64(data, i * 2 + 1);
+
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    k1 = 0;
+    k2 = 0;
+    switch (len & 15) {
+    case 15: k2 ^= ((uint64_t) tail[14]) << 48;  /* fall through */
+    case 14: k2 ^= ((uint64_t) tail[13]) << 40;  /* fall through */
+    case 13: k2 ^= ((uint64_t) tail[12]) << 32;  /* fall through */
+    case 12: k2 ^= ((uint64_t) tail[11]) << 24;  /* fall through */
+    case 11: k2 ^= ((uint64_t) tail[10]) << 16;  /* fall through */
+    case 10: k2 ^= ((uint64_t) tail[9]) << 8;    /* fall through */
+    case  9: k2 ^= ((uint64_t) tail[8]);
+             k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+             /* fall through */
+    case  8: k1 ^= ((uint64_t) tail[7]) << 56;   /* fall through */
+    case  7: k1 ^= ((uint64_t) tail[6]) << 48;   /* fall through */
+    case  6: k1 ^= ((uint64_t) tail[5]) << 40;   /* fall through */
+    case  5: k1 ^= ((uint64_t) tail[4]) << 32;   /* fall through */
+    case  4: k1 ^= ((uint64_t) tail[3]) << 24;   /* fall through */
+    case  3: k1 ^= ((uint64_t) tail[2]) << 16;   /* fall through */
+    case  2: k1 ^= ((uint64_t) tail[1]) << 8;    /* fall through */
+    case  1: k1 ^= ((uint64_t) tail[0]);
+             k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= (uint64_t) len;
+    h2 ^= (uint64_t) len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+
+    out[0] = h1;
+    out[1] = h2;
+}
+
+static PyObject *murmur_hexdigest(PyObject *self, PyObject *args)
+{
+    static const char hexdigits[] = "0123456789abcdef";
+    Py_buffer buf;
+    unsigned long seed;
+    uint64_t hash[2];
+    char hex[32];
+    int i;
+
+    /* s* accepts str (hashed as UTF-8) and any contiguous buffer */
+    if (!PyArg_ParseTuple(args, "s*k:hexdigest", &buf, &seed))
+        return NULL;
+    if (buf.len >= NOGIL_THRESHOLD) {
+        Py_BEGIN_ALLOW_THREADS
+        murmur3_x64_128(buf.buf, buf.len, (uint32_t) seed, hash);
+        Py_END_ALLOW_THREADS
+    } else {
+        murmur3_x64_128(buf.buf, buf.len, (uint32_t) seed, hash);
+    }
+    PyBuffer_Release(&buf);
+
+    /* Same byte order as mmh3.hash_bytes(): h1 then h2, little-endian */
+    for (i = 0; i < 16; i++) {
+        uint8_t byte = hash[i / 8] >> (8 * (i % 8));
+        hex[2 * i] = hexdigits[byte >> 4];
+        hex[2 * i + 1] = hexdigits[byte & 0xf];
+    }
+    return PyUnicode_FromStringAndSize(hex, sizeof(hex));
+}
+
+static PyMethodDef murmur_methods[] = {
+    {"hexdigest", murmur_hexdigest, METH_VARARGS,
+     "hexdigest(data, seed) -> lower-case hex MurmurHash3_x64_128 of data"},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef murmur_module = {
+    PyModuleDef_HEAD_INIT,
+    "opendiamond._murmur",
+    "Native MurmurHash3_x64_128.",
+    -1,
+    murmur_methods,
+};
+
+PyMODINIT_FUNC PyInit__murmur(void)
+{
+    return PyModule_Create(&murmur_module);
+}
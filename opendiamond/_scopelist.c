@@ -0,0 +1,679 @@
+/*
+ *  The OpenDiamond Platform for Interactive Search
+ *
+ *  Copyright (c) 2011-2019 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  This software is distributed under the terms of the Eclipse Public
+ *  License, Version 1.0 which can be found in the file named LICENSE.
+ *  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+ *  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+ */
+
+/*
+ * Incremental scope list parser for opendiamond.server.scopelist.
+ *
+ * Parses either the XML scope list format, which is simple enough not to
+ * need a general XML parser (UTF-8 only; no internal DTD subsets), or the
+ * length-prefixed binary format described in scopelist.py.  feed() returns
+ * a list of (id, src, meta, extra) tuples for the <object/> elements
+ * completed so far, where missing attributes are None and extra is a dict
+ * of any other attributes, or None.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include "structmember.h"
+#include <stdint.h>
+#include <string.h>
+
+#define BINARY_MAGIC "DSC1"
+#define BINARY_MAGIC_LEN 4
+#define BINARY_HEADER_LEN 5
+
+typedef struct {
+    PyObject_HEAD
+    char *buf;
+    Py_ssize_t start;       /* first unparsed byte */
+    Py_ssize_t len;         /* end of data */
+    Py_ssize_t cap;
+    int binary;
+    int started;            /* root element or magic seen */
+    int finished;           /* root element closed or end record seen */
+    int depth;              /* open XML elements */
+    long long count;        /* object count announced so far */
+} Parser;
+
+static void parse_error(const char *msg)
+{
+    PyErr_Format(PyExc_ValueError, "scope list: %s", msg);
+}
+
+static int is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int add_count(Parser *self, PyObject *value)
+{
+    PyObject *num = PyLong_FromUnicodeObject(value, 10);
+    long long adjust;
+
+    if (num == NULL)
+        return -1;
+    adjust = PyLong_AsLongLong(num);
+    Py_DECREF(num);
+    if (adjust == -1 && PyErr_Occurred())
+        return -1;
+    self->count += adjust;
+    return 0;
+}
+
+/* Append UTF-8 for code point c at out */
+static char *put_utf8(char *out, unsigned long c)
+{
+    if (c < 0x80) {
+        *out++ = c;
+    } else if (c < 0x800) {
+        *out++ = 0xc0 | (c >> 6);
+        *out++ = 0x80 | (c & 0x3f);
+    } else if (c < 0x10000) {
+        *out++ = 0xe0 | (c >> 12);
+        *out++ = 0x80 | ((c >> 6) & 0x3f);
+        *out++ = 0x80 | (c & 0x3f);
+    } else {
+        *out++ = 0xf0 | (c >> 18);
+        *out++ = 0x80 | ((c >> 12) & 0x3f);
+        *out++ = 0x80 | ((c >> 6) & 0x3f);
+        *out++ = 0x80 | (c & 0x3f);
+    }
+    return out;
+}
+
+/* Decode an attribute value, expanding entity references and normalizing
+   whitespace.  The result is never longer than the input. */
+static PyObject *decode_value(const char *s, Py_ssize_t n)
+{
+    char *out, *o;
+    const char *end = s + n;
+    PyObject *ret;
+
+    if (memchr(s, '&', n) == NULL && memchr(s, '\t', n) == NULL &&
+        memchr(s, '\n', n) == NULL && memchr(s, '\r', n) == NULL)
+        return PyUnicode_DecodeUTF8(s, n, "strict");
+
+    out = o = PyMem_Malloc(n ? n : 1);
+    if (out == NULL)
+        return PyErr_NoMemory();
+    while (s < end) {
+        if (*s == '&') {
+            const char *semi = memchr(s, ';', end - s);
+            Py_ssize_t len;
+
+            if (semi == NULL)
+                goto bad;
+            len = semi - s - 1;
+            if (len == 2 && !memcmp(s + 1, "lt", 2)) {
+                *o++ = '<';
+            } else if (len == 2 && !memcmp(s + 1, "gt", 2)) {
+                *o++ = '>';
+            } else if (len == 3 && !memcmp(s + 1, "amp", 3)) {
+                *o++ = '&';
+            } else if (len == 4 && !memcmp(s + 1, "quot", 4)) {
+                *o++ = '"';
+            } else if (len == 4 && !memcmp(s + 1, "apos", 4)) {
+                *o++ = '\'';
+            } else if (len >= 2 && s[1] == '#') {
+                unsigned long c = 0;
+                const char *d = s + 2;
+                int hex = (*d == 'x');
+
+                if (hex)
+                    d++;
+                if (d == semi)
+                    goto bad;
+                for (; d < semi; d++) {
+                    int digit;
+                    if (*d >= '0' && *d <= '9')
+                        digit = *d - '0';
+                    else if (hex && *d >= 'a' && *d <= 'f')
+                        digit = *d - 'a' + 10;
+                    else if (hex && *d >= 'A' && *d <= 'F')
+                        digit = *d - 'A' + 10;
+                    else
+                        goto bad;
+                    c = c * (hex ? 16 : 10) + digit;
+                    if (c > 0x10ffff)
+                        goto bad;
+                }
+                if (c == 0)
+                    goto bad;
+                o = put_utf8(o, c);
+            } else {
+                goto bad;
+            }
+            s = semi + 1;
+        } else if (is_space(*s)) {
+            *o++ = ' ';
+            s++;
+        } else {
+            *o++ = *s++;
+        }
+    }
+    ret = PyUnicode_DecodeUTF8(out, o - out, "strict");
+    PyMem_Free(out);
+    return ret;
+
+bad:
+    PyMem_Free(out);
+    parse_error("bad entity reference");
+    return NULL;
+}
+
+/* Handle a start tag between '<' and '>' or '/>' exclusive */
+static int handle_start_tag(Parser *self, const char *p, const char *end,
+                            int self_closing, PyObject *results)
+{
+    const char *name = p;
+    Py_ssize_t name_len;
+    PyObject *fields[3] = {NULL, NULL, NULL};  /* id, src, meta */
+    PyObject *extra = NULL;
+    int is_object, is_objectlist, is_count, ret = -1, i;
+
+    while (p < end && !is_space(*p))
+        p++;
+    name_len = p - name;
+    is_object = (name_len == 6 && !memcmp(name, "object", 6));
+    is_objectlist = (name_len == 10 && !memcmp(name, "objectlist", 10));
+    is_count = (name_len == 5 && !memcmp(name, "count", 5));
+    if (name_len == 0) {
+        parse_error("bad element");
+        return -1;
+    }
+    self->started = 1;
+
+    for (;;) {
+        const char *attr, *value;
+        Py_ssize_t attr_len;
+        char quote;
+        PyObject *decoded;
+
+        while (p < end && is_space(*p))
+            p++;
+        if (p == end)
+            break;
+        attr = p;
+        while (p < end && !is_space(*p) && *p != '=')
+            p++;
+        attr_len = p - attr;
+        while (p < end && is_space(*p))
+            p++;
+        if (p == end || *p != '=')
+            goto bad;
+        p++;
+        while (p < end && is_space(*p))
+            p++;
+        if (p == end || (*p != '"' && *p != '\''))
+            goto bad;
+        quote = *p++;
+        value = p;
+        p = memchr(p, quote, end - p);
+        if (p == NULL)
+            goto bad;
+        p++;
+
+        if (!is_object && !is_objectlist && !is_count)
+            continue;
+        decoded = decode_value(value, p - 1 - value);
+        if (decoded == NULL)
+            goto out;
+        if (is_objectlist && attr_len == 5 && !memcmp(attr, "count", 5)) {
+            i = add_count(self, decoded);
+            Py_DECREF(decoded);
+            if (i == -1)
+                goto out;
+        } else if (is_count && attr_len == 6 && !memcmp(attr, "adjust", 6)) {
+            i = add_count(self, decoded);
+            Py_DECREF(decoded);
+            if (i == -1)
+                goto out;
+            is_count = 2;
+        } else if (is_object && attr_len == 2 && !memcmp(attr, "id", 2)) {
+            Py_XSETREF(fields[0], decoded);
+        } else if (is_object && attr_len == 3 && !memcmp(attr, "src", 3)) {
+            Py_XSETREF(fields[1], decoded);
+        } else if (is_object && attr_len == 4 && !memcmp(attr, "meta", 4)) {
+            Py_XSETREF(fields[2], decoded);
+        } else if (is_object) {
+            PyObject *key = PyUnicode_DecodeUTF8(attr, attr_len, "strict");
+            if (key == NULL || (extra == NULL &&
+                                (extra = PyDict_New()) == NULL)) {
+                Py_XDECREF(key);
+                Py_DECREF(decoded);
+                goto out;
+            }
+            i = PyDict_SetItem(extra, key, decoded);
+            Py_DECREF(key);
+            Py_DECREF(decoded);
+            if (i == -1)
+                goto out;
+        } else {
+            Py_DECREF(decoded);
+        }
+    }
+
+    if (is_count == 1) {
+        parse_error("<count> without adjust");
+        goto out;
+    }
+    if (is_object) {
+        PyObject *entry = PyTuple_New(4);
+        if (entry == NULL)
+            goto out;
+        for (i = 0; i < 3; i++) {
+            PyObject *field = fields[i] ? fields[i] : Py_None;
+            Py_INCREF(field);
+            PyTuple_SET_ITEM(entry, i, field);
+        }
+        if (extra == NULL) {
+            Py_INCREF(Py_None);
+            PyTuple_SET_ITEM(entry, 3, Py_None);
+        } else {
+            PyTuple_SET_ITEM(entry, 3, extra);
+            extra = NULL;
+        }
+        i = PyList_Append(results, entry);
+        Py_DECREF(entry);
+        if (i == -1)
+            goto out;
+    }
+    if (self_closing) {
+        if (self->depth == 0)
+            self->finished = 1;
+    } else {
+        self->depth++;
+    }
+    ret = 0;
+    goto out;
+
+bad:
+    parse_error("bad attribute");
+out:
+    for (i = 0; i < 3; i++)
+        Py_XDECREF(fields[i]);
+    Py_XDECREF(extra);
+    return ret;
+}
+
+/* Find the '>' ending the tag starting at p, outside quoted values */
+static const char *find_tag_end(const char *p, const char *end)
+{
+    char quote = 0;
+
+    for (; p < end; p++) {
+        if (quote) {
+            if (*p == quote)
+                quote = 0;
+        } else if (*p == '"' || *p == '\'') {
+            quote = *p;
+        } else if (*p == '>') {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static const char *find_string(const char *p, const char *end,
+                               const char *needle)
+{
+    size_t n = strlen(needle);
+
+    while (end - p >= (Py_ssize_t) n) {
+        const char *c = memchr(p, needle[0], end - p - n + 1);
+        if (c == NULL)
+            return NULL;
+        if (!memcmp(c, needle, n))
+            return c;
+        p = c + 1;
+    }
+    return NULL;
+}
+
+static int starts_with(const char *p, const char *end, const char *prefix,
+                       int *incomplete)
+{
+    size_t n = strlen(prefix);
+
+    if ((size_t) (end - p) < n) {
+        if (!memcmp(p, prefix, end - p))
+            *incomplete = 1;
+        return 0;
+    }
+    return !memcmp(p, prefix, n);
+}
+
+/* Parse as much buffered XML as possible */
+static int parse_xml(Parser *self, PyObject *results)
+{
+    const char *base = self->buf;
+    const char *p = base + self->start;
+    const char *end = base + self->len;
+
+    for (;;) {
+        const char *close;
+        int incomplete = 0;
+
+        p = memchr(p, '<', end - p);
+        if (p == NULL) {
+            p = end;
+            break;
+        }
+        if (end - p < 2)
+            break;
+        if (p[1] == '?') {
+            close = find_string(p + 2, end, "?>");
+            if (close == NULL)
+                break;
+            p = close + 2;
+        } else if (starts_with(p, end, "<!--", &incomplete)) {
+            close = find_string(p + 4, end, "-->");
+            if (close == NULL)
+                break;
+            p = close + 3;
+        } else if (starts_with(p, end, "<![CDATA[", &incomplete)) {
+            close = find_string(p + 9, end, "]]>");
+            if (close == NULL)
+                break;
+            p = close + 3;
+        } else if (incomplete) {
+            break;
+        } else if (p[1] == '!') {
+            close = memchr(p, '>', end - p);
+            if (close == NULL)
+                break;
+            p = close + 1;
+        } else if (p[1] == '/') {
+            close = memchr(p, '>', end - p);
+            if (close == NULL)
+                break;
+            if (--self->depth < 0) {
+                parse_error("mismatched tag");
+                return -1;
+            }
+            if (self->depth == 0)
+                self->finished = 1;
+            p = close + 1;
+        } else {
+            int self_closing;
+
+            close = find_tag_end(p + 1, end);
+            if (close == NULL)
+                break;
+            if (self->finished) {
+                parse_error("junk after document element");
+                return -1;
+            }
+            self_closing = (close[-1] == '/');
+            if (handle_start_tag(self, p + 1, close - self_closing,
+                                 self_closing, results) == -1)
+                return -1;
+            p = close + 1;
+        }
+    }
+    self->start = p - base;
+    return 0;
+}
+
+/* Parse as many complete binary records as possible */
+static int parse_binary(Parser *self, PyObject *results)
+{
+    const unsigned char *base = (const unsigned char *) self->buf;
+    const unsigned char *p = base + self->start;
+    const unsigned char *end = base + self->len;
+
+    if (!self->started) {
+        if (end - p < BINARY_MAGIC_LEN)
+            return 0;
+        if (memcmp(p, BINARY_MAGIC, BINARY_MAGIC_LEN)) {
+            parse_error("bad magic number");
+            return -1;
+        }
+        p += BINARY_MAGIC_LEN;
+        self->started = 1;
+    }
+    while (end - p >= BINARY_HEADER_LEN) {
+        unsigned char type = p[0];
+        uint32_t len = ((uint32_t) p[1] << 24) | ((uint32_t) p[2] << 16) |
+                       ((uint32_t) p[3] << 8) | p[4];
+        const unsigned char *rec = p + BINARY_HEADER_LEN;
+
+        if ((size_t) (end - rec) < len)
+            break;
+        if (self->finished) {
+            parse_error("data after end record");
+            return -1;
+        }
+        if (type == 'C') {
+            uint64_t adjust = 0;
+            int i;
+            if (len != 8) {
+                parse_error("bad count record");
+                return -1;
+            }
+            for (i = 0; i < 8; i++)
+                adjust = (adjust << 8) | rec[i];
+            self->count += (int64_t) adjust;
+        } else if (type == 'O') {
+            PyObject *fields[3] = {NULL, NULL, NULL};
+            PyObject *extra = NULL, *entry = NULL;
+            const unsigned char *f = rec, *rec_end = rec + len;
+            int i, ok = 0;
+
+            while (f < rec_end) {
+                const unsigned char *key = f, *value, *value_end;
+                PyObject *decoded;
+
+                f = memchr(f, '\0', rec_end - f);
+                if (f == NULL)
+                    goto bad_object;
+                value = ++f;
+                value_end = memchr(f, '\0', rec_end - f);
+                if (value_end == NULL)
+                    goto bad_object;
+                f = value_end + 1;
+                decoded = PyUnicode_DecodeUTF8((const char *) value,
+                                               value_end - value, "strict");
+                if (decoded == NULL)
+                    goto object_out;
+                i = value - 1 - key;
+                if (i == 2 && !memcmp(key, "id", 2)) {
+                    Py_XSETREF(fields[0], decoded);
+                } else if (i == 3 && !memcmp(key, "src", 3)) {
+                    Py_XSETREF(fields[1], decoded);
+                } else if (i == 4 && !memcmp(key, "meta", 4)) {
+                    Py_XSETREF(fields[2], decoded);
+                } else {
+                    PyObject *k = PyUnicode_DecodeUTF8((const char *) key, i,
+                                                       "strict");
+                    int err;
+                    if (k == NULL || (extra == NULL &&
+                                      (extra = PyDict_New()) == NULL)) {
+                        Py_XDECREF(k);
+                        Py_DECREF(decoded);
+                        goto object_out;
+                    }
+                    err = PyDict_SetItem(extra, k, decoded);
+                    Py_DECREF(k);
+                    Py_DECREF(decoded);
+                    if (err == -1)
+                        goto object_out;
+                }
+            }
+            entry = PyTuple_New(4);
+            if (entry == NULL)
+                goto object_out;
+            for (i = 0; i < 3; i++) {
+                PyObject *field = fields[i] ? fields[i] : Py_None;
+                Py_INCREF(field);
+                PyTuple_SET_ITEM(entry, i, field);
+            }
+            if (extra == NULL)
+                Py_INCREF(Py_None);
+            PyTuple_SET_ITEM(entry, 3, extra ? extra : Py_None);
+            extra = NULL;
+            ok = PyList_Append(results, entry) == 0;
+            goto object_out;
+bad_object:
+            parse_error("bad object record");
+object_out:
+            for (i = 0; i < 3; i++)
+                Py_XDECREF(fields[i]);
+            Py_XDECREF(extra);
+            Py_XDECREF(entry);
+            if (!ok)
+                return -1;
+        } else if (type == 'E') {
+            self->finished = 1;
+        } else {
+            parse_error("unknown record type");
+            return -1;
+        }
+        p = rec + len;
+    }
+    self->start = (const char *) p - self->buf;
+    return 0;
+}
+
+static int Parser_init(Parser *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"binary", NULL};
+    int binary = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p:Parser", kwlist,
+                                     &binary))
+        return -1;
+    self->binary = binary;
+    self->start = self->len = 0;
+    self->started = self->finished = self->depth = 0;
+    self->count = 0;
+    return 0;
+}
+
+static void Parser_dealloc(Parser *self)
+{
+    PyMem_Free(self->buf);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *Parser_feed(Parser *self, PyObject *args)
+{
+    Py_buffer data;
+    PyObject *results;
+    int err;
+
+    if (!PyArg_ParseTuple(args, "y*:feed", &data))
+        return NULL;
+
+    /* Discard parsed data, then append */
+    if (self->start > 0) {
+        memmove(self->buf, self->buf + self->start, self->len - self->start);
+        self->len -= self->start;
+        self->start = 0;
+    }
+    if (self->len + data.len > self->cap) {
+        Py_ssize_t cap = (self->len + data.len) * 2;
+        char *buf = PyMem_Realloc(self->buf, cap);
+        if (buf == NULL) {
+            PyBuffer_Release(&data);
+            return PyErr_NoMemory();
+        }
+        self->buf = buf;
+        self->cap = cap;
+    }
+    memcpy(self->buf + self->len, data.buf, data.len);
+    self->len += data.len;
+    PyBuffer_Release(&data);
+
+    results = PyList_New(0);
+    if (results == NULL)
+        return NULL;
+    if (self->binary)
+        err = parse_binary(self, results);
+    else
+        err = parse_xml(self, results);
+    if (err == -1) {
+        Py_DECREF(results);
+        return NULL;
+    }
+    return results;
+}
+
+static PyObject *Parser_close(Parser *self, PyObject *unused)
+{
+    Py_ssize_t i;
+
+    if (!self->finished) {
+        parse_error("incomplete scope list");
+        return NULL;
+    }
+    for (i = self->start; i < self->len; i++) {
+        if (self->binary || !is_space(self->buf[i])) {
+            parse_error("junk after end of scope list");
+            return NULL;
+        }
+    }
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef Parser_methods[] = {
+    {"feed", (PyCFunction) Parser_feed, METH_VARARGS,
+     "feed(data) -> list of (id, src, meta, extra) for completed objects"},
+    {"close", (PyCFunction) Parser_close, METH_NOARGS,
+     "Raise ValueError if the scope list is incomplete."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyMemberDef Parser_members[] = {
+    {"count", T_LONGLONG, offsetof(Parser, count), READONLY,
+     "Number of objects announced by the scope list so far"},
+    {NULL, 0, 0, 0, NULL}
+};
+
+static PyTypeObject ParserType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "opendiamond._scopelist.Parser",
+    .tp_basicsize = sizeof(Parser),
+    .tp_dealloc = (destructor) Parser_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Parser(binary=False): incremental scope list parser",
+    .tp_methods = Parser_methods,
+    .tp_members = Parser_members,
+    .tp_init = (initproc) Parser_init,
+    .tp_new = PyType_GenericNew,
+};
+
+static struct PyModuleDef scopelist_module = {
+    PyModuleDef_HEAD_INIT,
+    "opendiamond._scopelist",
+    "Native incremental scope list parser.",
+    -1,
+    NULL,
+};
+
+PyMODINIT_FUNC PyInit__scopelist(void)
+{
+    PyObject *module;
+
+    if (PyType_Ready(&ParserType) < 0)
+        return NULL;
+    module = PyModule_Create(&scopelist_module);
+    if (module == NULL)
+        return NULL;
+    Py_INCREF(&ParserType);
+    if (PyModule_AddObject(module, "Parser", (PyObject *) &ParserType) < 0) {
+        Py_DECREF(&ParserType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
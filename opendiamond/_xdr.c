@@ -0,0 +1,254 @@
+/*
+ *  The OpenDiamond Platform for Interactive Search
+ *
+ *  Copyright (c) 2011 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  This software is distributed under the terms of the Eclipse Public
+ *  License, Version 1.0 which can be found in the file named LICENSE.
+ *  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+ *  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+ */
+
+/*
+ * Native XDR codec for the attribute array of XDR_object, which is
+ * encoded for every object sent on the blast channel:
+ *
+ *   uint count
+ *   count * { string name; opaque value<>; }
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Values at least this large are not copied into the send buffer, but
+   returned as separate segments for scatter-gather I/O */
+#define GATHER_THRESHOLD (64 << 10)
+
+#define PAD4(n) (((n) + 3) & ~(Py_ssize_t) 3)
+
+struct attr {
+    const char *name;
+    Py_ssize_t name_len;
+    Py_buffer value;
+};
+
+static char *put_uint(char *p, uint32_t value)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+    return p + 4;
+}
+
+static uint32_t get_uint(const unsigned char *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+           ((uint32_t) p[2] << 8) | p[3];
+}
+
+/* Append buf[start:end] to segments, if not empty */
+static int add_slice(PyObject *segments, PyObject *view, Py_ssize_t start,
+                     Py_ssize_t end)
+{
+    PyObject *slice;
+    int ret;
+
+    if (start == end)
+        return 0;
+    slice = PySequence_GetSlice(view, start, end);
+    if (slice == NULL)
+        return -1;
+    ret = PyList_Append(segments, slice);
+    Py_DECREF(slice);
+    return ret;
+}
+
+static PyObject *xdr_pack_attributes(PyObject *self, PyObject *args)
+{
+    PyObject *pairs, *seq, *segments = NULL, *buf = NULL, *view = NULL;
+    struct attr *attrs;
+    Py_ssize_t count, acquired = 0, size = 4, i, start = 0;
+    char *p;
+
+    if (!PyArg_ParseTuple(args, "O:pack_attributes", &pairs))
+        return NULL;
+    seq = PySequence_Fast(pairs, "attributes must be a sequence");
+    if (seq == NULL)
+        return NULL;
+    count = PySequence_Fast_GET_SIZE(seq);
+    attrs = PyMem_New(struct attr, count ? count : 1);
+    if (attrs == NULL) {
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+
+    /* Collect names and values, and size the send buffer */
+    for (i = 0; i < count; i++) {
+        PyObject *pair = PySequence_Fast_GET_ITEM(seq, i);
+        struct attr *attr = &attrs[i];
+
+        if (!PyTuple_Check(pair) || PyTuple_GET_SIZE(pair) != 2) {
+            PyErr_SetString(PyExc_TypeError,
+                            "attributes must be (name, value) tuples");
+            goto out;
+        }
+        attr->name = PyUnicode_AsUTF8AndSize(PyTuple_GET_ITEM(pair, 0),
+                                             &attr->name_len);
+        if (attr->name == NULL)
+            goto out;
+        if (PyObject_GetBuffer(PyTuple_GET_ITEM(pair, 1), &attr->value,
+                               PyBUF_CONTIG_RO) == -1)
+            goto out;
+        acquired++;
+        if (attr->name_len > UINT32_MAX || attr->value.len > UINT32_MAX) {
+            PyErr_SetString(PyExc_ValueError, "attribute too large");
+            goto out;
+        }
+        size += 4 + PAD4(attr->name_len) + 4;
+        if (attr->value.len >= GATHER_THRESHOLD)
+            size += PAD4(attr->value.len) - attr->value.len;
+        else
+            size += PAD4(attr->value.len);
+    }
+
+    buf = PyByteArray_FromStringAndSize(NULL, size);
+    if (buf == NULL)
+        goto out;
+    view = PyMemoryView_FromObject(buf);
+    segments = PyList_New(0);
+    if (view == NULL || segments == NULL)
+        goto out;
+
+    /* Encode, copying small values and splitting around large ones */
+    p = PyByteArray_AS_STRING(buf);
+    memset(p, 0, size);
+    p = put_uint(p, count);
+    for (i = 0; i < count; i++) {
+        struct attr *attr = &attrs[i];
+        Py_ssize_t pos;
+
+        p = put_uint(p, attr->name_len);
+        memcpy(p, attr->name, attr->name_len);
+        p += PAD4(attr->name_len);
+        p = put_uint(p, attr->value.len);
+        if (attr->value.len >= GATHER_THRESHOLD) {
+            pos = p - PyByteArray_AS_STRING(buf);
+            if (add_slice(segments, view, start, pos) == -1 ||
+                PyList_Append(segments, attr->value.obj) == -1) {
+                Py_CLEAR(segments);
+                goto out;
+            }
+            start = pos;
+            /* Padding is left in the buffer */
+            p += PAD4(attr->value.len) - attr->value.len;
+        } else {
+            memcpy(p, attr->value.buf, attr->value.len);
+            p += PAD4(attr->value.len);
+        }
+    }
+    if (add_slice(segments, view, start, size) == -1)
+        Py_CLEAR(segments);
+
+out:
+    for (i = 0; i < acquired; i++)
+        PyBuffer_Release(&attrs[i].value);
+    PyMem_Free(attrs);
+    Py_DECREF(seq);
+    Py_XDECREF(view);
+    Py_XDECREF(buf);
+    return segments;
+}
+
+static PyObject *xdr_unpack_attributes(PyObject *self, PyObject *args)
+{
+    Py_buffer data;
+    const unsigned char *p, *end;
+    PyObject *attrs = NULL;
+    uint32_t count, i;
+
+    if (!PyArg_ParseTuple(args, "y*:unpack_attributes", &data))
+        return NULL;
+    p = data.buf;
+    end = p + data.len;
+
+#define NEED(n) \
+    if ((size_t) (end - p) < (size_t) (n)) { \
+        PyErr_SetString(PyExc_ValueError, "truncated XDR data"); \
+        goto fail; \
+    }
+
+    NEED(4);
+    count = get_uint(p);
+    p += 4;
+    /* Each attribute takes at least 8 bytes */
+    NEED((uint64_t) count * 8);
+    attrs = PyList_New(count);
+    if (attrs == NULL)
+        goto fail;
+    for (i = 0; i < count; i++) {
+        PyObject *name, *value, *pair;
+        const unsigned char *name_buf;
+        uint32_t name_len, value_len;
+
+        NEED(4);
+        name_len = get_uint(p);
+        p += 4;
+        NEED(PAD4((Py_ssize_t) name_len) + 4);
+        name_buf = p;
+        p += PAD4((Py_ssize_t) name_len);
+        value_len = get_uint(p);
+        p += 4;
+        NEED(PAD4((Py_ssize_t) value_len));
+
+        name = PyUnicode_DecodeUTF8((const char *) name_buf, name_len,
+                                    "strict");
+        value = PyBytes_FromStringAndSize((const char *) p, value_len);
+        p += PAD4((Py_ssize_t) value_len);
+        pair = (name && value) ? PyTuple_Pack(2, name, value) : NULL;
+        Py_XDECREF(name);
+        Py_XDECREF(value);
+        if (pair == NULL)
+            goto fail;
+        PyList_SET_ITEM(attrs, i, pair);
+    }
+    if (p != end) {
+        PyErr_SetString(PyExc_ValueError, "unconsumed XDR data");
+        goto fail;
+    }
+#undef NEED
+
+    PyBuffer_Release(&data);
+    return attrs;
+
+fail:
+    Py_XDECREF(attrs);
+    PyBuffer_Release(&data);
+    return NULL;
+}
+
+static PyMethodDef xdr_methods[] = {
+    {"pack_attributes", xdr_pack_attributes, METH_VARARGS,
+     "pack_attributes(pairs) -> list of buffers encoding the (name, value) "
+     "pairs as an XDR_object"},
+    {"unpack_attributes", xdr_unpack_attributes, METH_VARARGS,
+     "unpack_attributes(data) -> list of (name, value) pairs decoded from "
+     "an XDR_object"},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef xdr_module = {
+    PyModuleDef_HEAD_INIT,
+    "opendiamond._xdr",
+    "Native XDR codec for blast channel objects.",
+    -1,
+    xdr_methods,
+};
+
+PyMODINIT_FUNC PyInit__xdr(void)
+{
+    return PyModule_Create(&xdr_module);
+}
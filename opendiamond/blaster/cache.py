@@ -13,32 +13,32 @@
 from future import standard_library
 standard_library.install_aliases()
 from builtins import object
-from collections import Mapping
+from collections import OrderedDict
+from collections.abc import Mapping
+import io
 import pickle as pickle
 from datetime import datetime
 from hashlib import sha256
 import logging
 import os
 import shutil
+import struct
 from tempfile import NamedTemporaryFile
-import zipfile
+import threading
 
 import dateutil.parser
 from dateutil.tz import tzutc
 
-_log = logging.getLogger(__name__)
-
-
-def _attr_key_to_member(key):
-    if key == '':
-        return '__OBJECT_DATA__'
-    return key
+# Search result logs kept open, with their indexes
+MAX_OPEN_LOGS = 64
 
+# Result record: object key digest, attribute table length, value data
+# length.  The table holds, for each attribute, its name length, name,
+# and value length; the values follow in the same order.
+_RECORD_HEADER = struct.Struct('>32sII')
+_TABLE_LENGTH = struct.Struct('>I')
 
-def _member_to_attr_key(name):
-    if name == '__OBJECT_DATA__':
-        return ''
-    return name
+_log = logging.getLogger(__name__)
 
 
 class SearchCacheLoadError(Exception):
@@ -46,30 +46,124 @@ class SearchCacheLoadError(Exception):
 
 
 class _CachedSearchResult(Mapping):
-    def __init__(self, path):  # pylint: disable=super-init-not-called
-        self._zip = zipfile.ZipFile(path, 'r')
+    def __init__(self, log, attrs):  # pylint: disable=super-init-not-called
+        self._log = log
+        # attribute key -> (offset, length)
+        self._attrs = attrs
 
     def __len__(self):
-        return len(self._zip.namelist())
+        return len(self._attrs)
 
     def __iter__(self):
-        return (_member_to_attr_key(n) for n in self._zip.namelist())
+        return iter(self._attrs)
 
     def __contains__(self, key):
-        return _attr_key_to_member(key) in self._zip.namelist()
+        return key in self._attrs
 
     def __getitem__(self, key):
-        return self._zip.read(_attr_key_to_member(key))
+        offset, length = self._attrs[key]
+        return self._log.read(offset, length)
+
+
+class _SearchResultLog(object):
+    '''Append-only log of the results of one search, with an in-memory
+    index of the location of each attribute value.'''
+
+    def __init__(self, path):
+        # Closed when the last reference goes away, so that pruning can't
+        # cause reads from a reused descriptor
+        self._fh = io.FileIO(path, 'a+')
+        # object key -> {attribute key: (offset, length)}
+        self._index = {}
+        self._end = 0
+        self._load()
+
+    def _load(self):
+        fd = self._fh.fileno()
+        size = os.fstat(fd).st_size
+        while self._end + _RECORD_HEADER.size <= size:
+            digest, table_len, data_len = _RECORD_HEADER.unpack(
+                os.pread(fd, _RECORD_HEADER.size, self._end))
+            start = self._end + _RECORD_HEADER.size
+            if start + table_len + data_len > size:
+                break
+            self._add(digest, os.pread(fd, table_len, start),
+                      start + table_len)
+            self._end = start + table_len + data_len
+        if self._end != size:
+            # Drop a record torn by a crash
+            _log.warning('Truncating search result log %s', self._fh.name)
+            os.ftruncate(fd, self._end)
+
+    def _add(self, digest, table, offset):
+        attrs = {}
+        pos = 0
+        while pos < len(table):
+            name_len, = _TABLE_LENGTH.unpack_from(table, pos)
+            pos += _TABLE_LENGTH.size
+            name = table[pos:pos + name_len].decode('utf-8')
+            pos += name_len
+            value_len, = _TABLE_LENGTH.unpack_from(table, pos)
+            pos += _TABLE_LENGTH.size
+            attrs[name] = (offset, value_len)
+            offset += value_len
+        # A later result for the same object replaces the earlier one
+        self._index[digest] = attrs
+
+    def append(self, object_key, result):
+        values = []
+        table = []
+        for k, v in result.items():
+            if not isinstance(v, bytes):
+                v = v.encode('utf-8')
+            name = k.encode('utf-8')
+            table.extend((_TABLE_LENGTH.pack(len(name)), name,
+                          _TABLE_LENGTH.pack(len(v))))
+            values.append(v)
+        table = b''.join(table)
+        digest = bytes.fromhex(object_key)
+        record = memoryview(b''.join(
+            [_RECORD_HEADER.pack(digest, len(table),
+                                 sum(len(v) for v in values)), table] +
+            values))
+        written = 0
+        try:
+            while written < len(record):
+                written += self._fh.write(record[written:])
+        except BaseException:
+            # Don't leave a partial record for the next one to follow,
+            # since the index assumes records start at _end
+            os.ftruncate(self._fh.fileno(), self._end)
+            raise
+        self._add(digest, table, self._end + _RECORD_HEADER.size + len(table))
+        self._end += len(record)
+
+    def lookup(self, object_key):
+        try:
+            digest = bytes.fromhex(object_key)
+        except ValueError:
+            raise KeyError(object_key)
+        return _CachedSearchResult(self, self._index[digest])
+
+    def read(self, offset, length):
+        return os.pread(self._fh.fileno(), length, offset)
 
 
 class SearchCache(object):
     '''Assumes single-threaded, single-process access to the cache
-    (except for pruning).'''
+    (except for pruning).
+
+    The results of each search are appended to a log in the search
+    directory; pruning a search removes the directory.'''
 
     def __init__(self, path):
         if not os.path.exists(path):
             os.makedirs(path)
         self._basedir = path
+        # Guards _logs against the pruning thread
+        self._lock = threading.Lock()
+        # search key -> _SearchResultLog, least recently used first
+        self._logs = OrderedDict()
 
     def _search_dir_path(self, search_key):
         return os.path.join(self._basedir, search_key)
@@ -80,8 +174,25 @@ class SearchCache(object):
     def _search_expiration_path(self, search_key):
         return os.path.join(self._search_dir_path(search_key), 'expires')
 
-    def _object_path(self, search_key, object_key):
-        return os.path.join(self._search_dir_path(search_key), object_key)
+    def _results_path(self, search_key):
+        return os.path.join(self._search_dir_path(search_key), 'results')
+
+    def _get_log(self, search_key, create=False):
+        with self._lock:
+            log = self._logs.pop(search_key, None)
+            if log is None:
+                path = self._results_path(search_key)
+                if not create and not os.path.exists(path):
+                    raise KeyError(search_key)
+                try:
+                    log = _SearchResultLog(path)
+                except (IOError, OSError):
+                    # Search directory doesn't exist
+                    raise KeyError(search_key)
+                if len(self._logs) >= MAX_OPEN_LOGS:
+                    self._logs.popitem(last=False)
+            self._logs[search_key] = log
+            return log
 
     def _object_key(self, object_id):
         return sha256(object_id).hexdigest()
@@ -132,22 +243,16 @@ class SearchCache(object):
 
     def put_search_result(self, search_key, object_id, result):
         '''result is a dict of object attributes.'''
-        fh = NamedTemporaryFile(dir=self._basedir, delete=False)
-        zf = zipfile.ZipFile(fh, 'w', zipfile.ZIP_STORED, True)
-        for k, v in result.items():
-            zf.writestr(_attr_key_to_member(k), v)
-        zf.close()
-        fh.close()
         object_key = self._object_key(object_id)
-        os.rename(fh.name, self._object_path(search_key, object_key))
+        try:
+            self._get_log(search_key, create=True).append(object_key,
+                                                          result)
+        except KeyError:
+            raise IOError('No such search: %s' % search_key)
         return object_key
 
     def get_search_result(self, search_key, object_key):
-        try:
-            return _CachedSearchResult(
-                self._object_path(search_key, object_key))
-        except IOError:
-            raise KeyError()
+        return self._get_log(search_key).lookup(object_key)
 
     def prune(self):
         '''May be run in a different thread.'''
@@ -164,6 +269,8 @@ class SearchCache(object):
                 # No expiration file ==> not a search
                 continue
             if exp_time < now:
+                with self._lock:
+                    self._logs.pop(search_key, None)
                 shutil.rmtree(self._search_dir_path(search_key))
                 expired += 1
         if expired:
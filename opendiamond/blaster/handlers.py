@@ -18,7 +18,6 @@ from builtins import str
 from builtins import object
 from io import StringIO
 from datetime import timedelta
-from hashlib import sha256
 import logging
 import os
 import time
@@ -33,7 +32,8 @@ from tornado.curl_httpclient import CurlAsyncHTTPClient as AsyncHTTPClient
 from tornado import gen
 from tornado.ioloop import IOLoop
 from tornado.options import define, options
-from tornado.web import asynchronous, RequestHandler, HTTPError
+from tornado.web import (
+    asynchronous, RequestHandler, HTTPError, stream_request_body)
 
 import opendiamond
 from opendiamond.attributes import (
@@ -45,6 +45,7 @@ from opendiamond.blaster.json import (
     ClientToServerEvent, ServerToClientEvent)
 from opendiamond.blaster.search import (
     Blob, EmptyBlob, DiamondSearch, FilterSpec)
+from opendiamond.blobcache import BlobMismatchError
 from opendiamond.helpers import connection_ok
 from opendiamond.protocol import DiamondRPCCookieExpired
 from opendiamond.rpc import ConnectionFailure, RPCError
@@ -64,6 +65,8 @@ define('enable_testui', default=True,
        help='Enable the example user interface')
 define('http_proxy', type=str, default=None,
        metavar='HOST:PORT', help='Use a proxy for HTTP client requests')
+define('max_blob_size', type=int, default=4 << 30,
+       metavar='BYTES', help='Largest blob accepted by POST /blob')
 
 _log = logging.getLogger(__name__)
 
@@ -175,18 +178,20 @@ class _BlasterRequestHandler(RequestHandler):
 
 
 class _BlasterBlob(Blob):
-    '''Instances with the same URI compare equal and hash to the same value.'''
+    '''Instances with the same URI compare equal and hash to the same value.
+    Fetched data is kept in the blob cache, and only read into memory when
+    the blob is sent.'''
 
     def __init__(self, uri, expected_sha256=None):
         Blob.__init__(self)
         self.uri = uri
         self._expected_sha256 = expected_sha256
-        self._data = None
+        self._blob_cache = None
 
     def __str__(self):
-        if self._data is None:
+        if self._blob_cache is None:
             raise RuntimeError('Attempting to read an unfetched blob')
-        return self._data
+        return self._blob_cache[self._sha256]
 
     def __repr__(self):
         return '<_BlasterBlob %s>' % (self.uri)
@@ -199,14 +204,17 @@ class _BlasterBlob(Blob):
 
     @gen.engine
     def fetch(self, blob_cache, callback=None):
-        if self._data is None:
+        if self._blob_cache is None:
             # Fetch data
             parts = urlparse(self.uri)
             if parts.scheme == 'blob':
-                try:
-                    data = blob_cache[parts.path]
-                except KeyError:
+                sig = parts.path.lower()
+                if sig not in blob_cache:
                     raise HTTPError(400, 'Blob missing from blob cache')
+                # Blob cache entries are named by their hash
+                if (self._expected_sha256 is not None and
+                        sig != self._expected_sha256.lower()):
+                    raise HTTPError(400, 'SHA-256 mismatch on %s' % self.uri)
             elif parts.scheme == 'http' or parts.scheme == 'https':
                 client = AsyncHTTPClient()
                 if options.http_proxy is not None:
@@ -214,25 +222,27 @@ class _BlasterBlob(Blob):
                     proxy_port = int(proxy_port)
                 else:
                     proxy_host = proxy_port = None
-                response = yield gen.Task(
-                    client.fetch, self.uri,
-                    user_agent='JSONBlaster/%s' % opendiamond.__version__,
-                    proxy_host=proxy_host, proxy_port=proxy_port,
-                    validate_cert=False)
-                if response.error:
-                    raise HTTPError(400, 'Error fetching <%s>: %s' % (
-                        self.uri, str(response.error)))
-                data = response.body
+                # Stream the response into the blob cache
+                with blob_cache.add_stream(self._expected_sha256) as writer:
+                    response = yield gen.Task(
+                        client.fetch, self.uri,
+                        user_agent='JSONBlaster/%s' % opendiamond.__version__,
+                        proxy_host=proxy_host, proxy_port=proxy_port,
+                        validate_cert=False, streaming_callback=writer.write)
+                    if response.error:
+                        raise HTTPError(400, 'Error fetching <%s>: %s' % (
+                            self.uri, str(response.error)))
+                    try:
+                        sig = writer.commit()
+                    except BlobMismatchError:
+                        raise HTTPError(400,
+                                        'SHA-256 mismatch on %s' % self.uri)
             else:
                 raise HTTPError(400, 'Unacceptable blob URI scheme')
 
-            # Check hash if requested
-            if self._expected_sha256 is not None:
-                if sha256(data).hexdigest() != self._expected_sha256:
-                    raise HTTPError(400, 'SHA-256 mismatch on %s' % self.uri)
-
             # Commit
-            self._data = data
+            self._sha256 = sig
+            self._blob_cache = blob_cache
 
         if callback is not None:
             callback()
@@ -329,13 +339,37 @@ class SearchHandler(_BlasterRequestHandler):
         self.finish()
 
 
+@stream_request_body
 class PostBlobHandler(_BlasterRequestHandler):
+    '''Adds the request body to the blob cache as it arrives.'''
+
+    _writer = None
+
     @_restricted
+    def prepare(self):
+        self.request.connection.set_max_body_size(options.max_blob_size)
+        self._writer = self.blob_cache.add_stream()
+
+    def data_received(self, chunk):
+        self._writer.write(chunk)
+
     def post(self):
-        sig = self.blob_cache.add(self.request.body)
+        sig = self._writer.commit()
         self.set_header('Location', '%s:%s' % (CACHE_URN_SCHEME, sig))
         self.set_status(204)
 
+    def _discard(self):
+        # Does nothing once the blob is committed
+        if self._writer is not None:
+            self._writer.abort()
+
+    def on_finish(self):
+        self._discard()
+
+    def on_connection_close(self):
+        _BlasterRequestHandler.on_connection_close(self)
+        self._discard()
+
 
 class EvaluateHandler(_BlasterRequestHandler):
     def initialize(self):
@@ -13,18 +13,88 @@
 '''On-disk caching of filter code and blob arguments.'''
 
 from builtins import object
+from collections import OrderedDict
 from hashlib import sha256
 import logging
+import mmap
 import os
 import shutil
 from tempfile import mktemp, mkstemp, mkdtemp
+import threading
 import time
 
 GC_SUFFIX = '-'
+# Update the mtime of a blob at most this often.  Must be well below the
+# configured blob lifetime.
+TOUCH_INTERVAL = 3600  # seconds
+# Keep mappings of up to this many bytes of recently read blobs open in
+# each process
+HOT_BYTES = 256 << 20
 
 _log = logging.getLogger(__name__)
 
 
+class BlobMismatchError(Exception):
+    '''Blob data did not match the expected signature.'''
+
+
+class BlobWriter(object):
+    '''Adds a blob to a BlobCache incrementally.  Data written with write()
+    goes to a temporary file in the cache directory while being hashed, so
+    the blob need not fit in memory.  commit() adds the blob to the cache
+    and returns its signature; abort() discards it.  Used as a context
+    manager, the blob is discarded unless committed.'''
+
+    def __init__(self, cache, expected_sig=None):
+        self._cache = cache
+        self._expected = expected_sig.lower() if expected_sig else None
+        self._hash = sha256()
+        # NamedTemporaryFile always deletes the file on close on Python 2.5,
+        # so we can't use it
+        fd, self._name = mkstemp(dir=cache.basedir)
+        self._file = os.fdopen(fd, 'wb')
+        self.size = 0
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, _type, _value, _tb):
+        self.abort()
+
+    def write(self, data):
+        '''Append data to the blob.'''
+        self._hash.update(data)
+        self._file.write(data)
+        self.size += len(data)
+
+    def commit(self):
+        '''Add the blob to the cache and return its signature.  Raise
+        BlobMismatchError if it does not have the expected signature.'''
+        sig = self._hash.hexdigest()
+        try:
+            if self._expected is not None and sig != self._expected:
+                raise BlobMismatchError('Expected blob %s, received %s' %
+                                        (self._expected, sig))
+            self._file.close()
+            os.chmod(self._name, 0o400)
+            try:
+                # pylint: disable=protected-access
+                os.link(self._name, self._cache._path(sig))
+            except OSError:
+                # Destination already exists.
+                pass
+        finally:
+            self.abort()
+        return sig
+
+    def abort(self):
+        '''Discard the blob, if not already committed.'''
+        if self._name is not None:
+            self._file.close()
+            os.unlink(self._name)
+            self._name = None
+
+
 class BlobCache(object):
     '''A cache of binary data identified by its SHA256 hash in hex.
 
@@ -51,10 +121,21 @@ class BlobCache(object):
     in the garbage collector and need to rescue the file.
     2a. To rescue the file, we rename it from %s- to %s and try again.
     The second attempt should succeed since the file's mtime is current.
+
+    To avoid a syscall on every access, each process updates the mtime of
+    a blob at most once per TOUCH_INTERVAL.  Blobs are read by mapping the
+    file; view() returns the mapping directly, so processes reading the
+    same blob share its pages in the page cache rather than each holding a
+    copy.  Recently read blobs stay mapped, up to HOT_BYTES per process.
+    view() may be called from several threads.
     '''
 
     def __init__(self, basedir):
         self.basedir = basedir
+        self._touched = dict()  # sig -> time of last mtime update
+        self._hot = OrderedDict()  # sig -> mmap, least recently used first
+        self._hot_bytes = 0
+        self._hot_lock = threading.Lock()  # protects _hot and _hot_bytes
 
     def _path(self, sig):
         return os.path.join(self.basedir, sig.lower())
@@ -78,11 +159,15 @@ class BlobCache(object):
         '''Update the mtime of the blob to prevent it from being
         garbage-collected.  Rescue the blob if necessary.  Raise KeyError
         if the blob is not in the cache.'''
+        now = time.time()
+        if now - self._touched.get(sig, 0) < TOUCH_INTERVAL:
+            return
         try:
             self._try_with_rescue(
                 sig, lambda: os.utime(self._path(sig), None), OSError)
         except OSError:
             raise KeyError()
+        self._touched[sig] = now
 
     def __contains__(self, sig):
         try:
@@ -91,34 +176,43 @@ class BlobCache(object):
         except KeyError:
             return False
 
-    # pylint is confused by the lambda expression
-    # pylint: disable=unnecessary-lambda
     def __getitem__(self, sig):
+        return self.view(sig).tobytes()
+
+    def _map(self, sig):
+        with open(self._path(sig), 'rb') as f:
+            if os.fstat(f.fileno()).st_size == 0:
+                # Can't map an empty file
+                return b''
+            return mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+    def view(self, sig):
+        '''Return a read-only memoryview of the blob without copying it.'''
         self._access(sig)
-        return self._try_with_rescue(
-            sig, lambda: open(self._path(sig), 'rb').read(), IOError)
-    # pylint: enable=unnecessary-lambda
+        with self._hot_lock:
+            data = self._hot.pop(sig, None)
+            if data is None:
+                data = self._try_with_rescue(sig, lambda: self._map(sig),
+                                             (IOError, OSError))
+                self._hot_bytes += len(data)
+                # Unmapping happens when the last view of an evicted blob
+                # is released
+                while self._hot and self._hot_bytes > HOT_BYTES:
+                    _sig, evicted = self._hot.popitem(last=False)
+                    self._hot_bytes -= len(evicted)
+            self._hot[sig] = data
+        return memoryview(data)
 
     def add(self, data):
         '''Add the specified data to the cache.'''
-        hash = sha256(data)
-        sig = hash.hexdigest()
-        # NamedTemporaryFile always deletes the file on close on Python 2.5,
-        # so we can't use it
-        fd, name = mkstemp(dir=self.basedir)
-        try:
-            temp = os.fdopen(fd, 'rb+')
-            temp.write(data)
-            temp.close()
-            os.chmod(name, 0o400)
-            try:
-                os.link(name, self._path(sig))
-            except OSError:
-                # Destination already exists.
-                pass
-        finally:
-            os.unlink(name)
-        return sig
+        with self.add_stream() as writer:
+            writer.write(data)
+            return writer.commit()
+
+    def add_stream(self, expected_sig=None):
+        '''Return a BlobWriter for adding a blob in pieces.  If
+        expected_sig is specified, the blob is only added if it matches.'''
+        return BlobWriter(self, expected_sig)
 
     @classmethod
     def prune(cls, basedir, max_days):
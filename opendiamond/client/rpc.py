@@ -145,6 +145,8 @@ class ControlConnection(_RPCClientConnection):
     start = _stub(28, protocol.XDR_start)
     reexecute_filters = _stub(30, protocol.XDR_reexecute,
                               protocol.XDR_attribute_list)
+    reexecute_filters_batch = _stub(32, protocol.XDR_reexecute_batch)
+    reexecute_results = _stub(33, None, protocol.XDR_reexecute_results)
     request_stats = _stub(29, None, protocol.XDR_search_stats)
     session_variables_get = _stub(18, None, protocol.XDR_session_vars)
     session_variables_set = _stub(19, None, protocol.XDR_session_vars)
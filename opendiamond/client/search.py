@@ -24,7 +24,7 @@ from hashlib import sha256
 from opendiamond.client.rpc import ControlConnection, BlastConnection
 from opendiamond.protocol import (
     XDR_setup, XDR_filter_config, XDR_blob_data, XDR_start, XDR_reexecute,
-    DiamondRPCFCacheMiss)
+    XDR_reexecute_batch, DiamondRPCFCacheMiss)
 from opendiamond.rpc import RPCError, ConnectionFailure
 from opendiamond.scope import get_cookie_map
 
@@ -215,6 +215,54 @@ class _DiamondConnection(object):
 
     reexecute = evaluate  # alias
 
+    def evaluate_batch(self, cookies, filters, blobs, attrs=None):
+        """
+        Re-execute several objects at once.  The server evaluates them in
+        parallel.
+        :param cookies:
+        :param filters:
+        :param blobs:
+        :param attrs:
+        :return: A generator yielding (blob, attribute dictionary) pairs as
+        objects finish, with None instead of a dictionary if re-execution
+        failed.
+        """
+        self.connect()
+        self.setup(cookies, filters)
+
+        uri_blobs = dict((self._blob_uri(b), b) for b in blobs)
+        resent = set()
+        self.control.reexecute_filters_batch(
+            XDR_reexecute_batch(object_ids=list(uri_blobs), attrs=attrs))
+        outstanding = len(uri_blobs)
+        while outstanding:
+            reply = self.control.reexecute_results()
+            if not reply.results:
+                raise RPCError('Server lost reexecution results')
+            missing = []
+            for result in reply.results:
+                outstanding -= 1
+                blob = uri_blobs[result.object_id]
+                if (result.status == DiamondRPCFCacheMiss.code and
+                        result.object_id not in resent):
+                    missing.append(result.object_id)
+                elif result.status:
+                    yield blob, None
+                else:
+                    dct = dict((attr.name, attr.value)
+                               for attr in result.attrs)
+                    if self._should_unpack_attrs:
+                        dct = self.unpack_attributes(dct)
+                    yield blob, dct
+            if missing:
+                # Send object data and retry
+                resent.update(missing)
+                self.control.send_blobs(XDR_blob_data(
+                    blobs=[uri_blobs[uri].data for uri in missing]))
+                self.control.reexecute_filters_batch(
+                    XDR_reexecute_batch(object_ids=missing, attrs=attrs))
+                outstanding += len(missing)
+
     def close(self):
         if not self._closed:
             self._closed = True
@@ -401,6 +449,26 @@ class DiamondSearch(object):
         if callback is not None:
             callback(obj)
 
+    def evaluate_batch(self, blobs, callback):
+        """
+        Re-execute several objects, in parallel on each server.
+        :param blobs: Blob objects wrapping the objects to re-execute.
+        :param callback: Called with (blob, attribute dictionary) as each
+        object finishes; the dictionary is None if re-execution failed.
+        """
+        # Send each blob to the server evaluate() would pick
+        hostnames = sorted(self._connections)
+        by_host = dict()
+        for blob in blobs:
+            server_index = abs(hash(blob.sha256)) % len(hostnames)
+            by_host.setdefault(hostnames[server_index], []).append(blob)
+
+        for hostname, host_blobs in by_host.items():
+            conn = self._connections[hostname]
+            for blob, obj in conn.evaluate_batch(self._cookie_map[hostname],
+                                                 self._filters, host_blobs):
+                callback(blob, obj)
+
     def get_stats(self):
         """
         Send statistics requests to all connections and aggregate the returned stats.
@@ -13,12 +13,14 @@
 '''Diamond configuration file parsing.'''
 
 from builtins import object
+import importlib
 import logging
 import os
 import socket
 
 import opendiamond
 from opendiamond.protocol import PORT
+from opendiamond.server.placement import PLACEMENT_POLICIES
 
 class DiamondConfigError(Exception):
     pass
@@ -103,12 +105,18 @@ class DiamondConfig(object):
             # -- diamondd
             # Cache directory expiration
             _Param('blob_cache_days', 'BLOBDAYS', 30),
+            # Compression for attribute cache values: lz4, zstd or zlib
+            _Param('cache_compression', 'CACHECOMPRESS', None),
             # Redis database
             _Param('cache_database', 'CACHEDB', 0),
             # Redis password
             _Param('cache_password', 'CACHEPASSWD', None),
             # Redis host and port
             _Param('cache_server', 'CACHE', None),
+            # Objects whose result cache entries are looked up together
+            _Param('cache_lookahead', 'CACHELOOKAHEAD', 16),
+            # Per-worker in-memory cache in front of Redis (MB)
+            _Param('cache_lru_memory', 'CACHELRUMEM', 64),
             # Cache directory
             _Param('cachedir', 'CACHEDIR', os.path.join(confdir, 'cache')),
             # PEM data for scope cookie signing certificates
@@ -118,12 +126,30 @@ class DiamondConfig(object):
             _Param('certfile', 'CERTFILE', os.path.join(confdir, 'CERTS')),
             # Root directory of control group filesystem
             _Param('cgroupdir', 'CGROUPDIR'),
+            # Placement of search workers and their filters on CPUs: none,
+            # numa (one NUMA node per worker) or cores (disjoint CPU sets)
+            _Param('cpu_placement', 'CPUPLACEMENT', 'none'),
             # Fork to background
             _Param('daemonize', None, True),
             # Debugger to use with debug_filters
             _Param('debug_command', None, 'valgrind'),
             # Names or signatures of filters to run under a debugger
             _Param('debug_filters', None, []),
+            # Seconds to keep idle filter processes for later searches;
+            # 0 to disable the filter pool.  Pooled filters keep state
+            # across searches, so only enable it for filters that allow it.
+            _Param('filter_pool_idle', 'FILTERPOOLIDLE', 0),
+            # Memory limit for the filter pool (MB)
+            _Param('filter_pool_memory', 'FILTERPOOLMEM', 4096),
+            # Periodically reorder independent filters in each worker so
+            # that cheap, selective ones run first (0 or 1)
+            _Param('filter_reorder', 'FILTERREORDER', 0),
+            # Per-object time budget reported to each filter (seconds;
+            # 0 for none)
+            _Param('filter_time_budget', 'FILTERBUDGET', 0),
+            # Kill filters which spend longer on an object (seconds; 0 to
+            # never kill)
+            _Param('filter_timeout', 'FILTERTIMEOUT', 0),
             # Number of days of logfiles to keep
             _Param('logdays', 'LOGDAYS', 14),
             # Directory for logfiles
@@ -132,14 +158,30 @@ class DiamondConfig(object):
             _Param('loglevel', 'LOGLEVEL', logging.INFO),
             # Don't fork when a connection arrives
             _Param('oneshot', None, False),
+            # Run independent filters on an object concurrently (0 or 1)
+            _Param('parallel_filters', 'PARALLELFILTERS', 0),
             # HTTP proxy
             _Param('http_proxy', 'HTTP_PROXY', None),
+            # Objects each worker fetches ahead from the dataretriever
+            # (0 to disable prefetching)
+            _Param('prefetch_objects', 'PREFETCH', 4),
+            # Memory each worker may use for prefetched objects (MB)
+            _Param('prefetch_memory', 'PREFETCHMEM', 64),
+            # Scope list URLs fetched concurrently
+            _Param('scope_fetchers', 'SCOPEFETCHERS', 4),
+            # Idle search processes forked ahead of connections (0 to fork
+            # when a connection arrives)
+            _Param('search_spares', 'SEARCHSPARES', 2),
             # Sentry error logging
             _Param('sentry_dsn', 'SENTRY_DSN', None),
             # Canonical server names
             _Param('serverids', 'SERVERID', []),
             # Worker threads per child process
             _Param('threads', 'THREADS', default_threads),
+            # Bounds for adding and retiring worker threads at runtime;
+            # no scaling unless max_threads exceeds threads
+            _Param('min_threads', 'MINTHREADS', 1),
+            _Param('max_threads', 'MAXTHREADS', 0),
             # HTTP user agent
             _Param('user_agent', None,
                    'OpenDiamond/%s' % opendiamond.__version__),
@@ -166,6 +208,17 @@ class DiamondConfig(object):
             _Param('flickr_api_key', 'FLICKR_KEY'),
             # Flickr store: API secret
             _Param('flickr_secret', 'FLICKR_SECRET'),
+            # Video store: cache directory for video durations and
+            # extracted segments
+            _Param('video_cachedir', 'VIDEOCACHEDIR',
+                   os.path.join(confdir, 'video-cache')),
+            # Video store: segment cache size (MB)
+            _Param('video_cache_size', 'VIDEOCACHESIZE', 1024),
+            # Video store: concurrent ffmpeg processes
+            _Param('video_workers', 'VIDEOWORKERS', 2),
+            # Video store: segments extracted ahead of requests, in scope
+            # order
+            _Param('video_prefetch', 'VIDEOPREFETCH', 2),
             # Mirage store: repository path
             _Param('mirage_repository', 'MIRAGE_REPOSITORY'),
             # YFCC100M store: metadata database
@@ -256,6 +309,27 @@ class DiamondConfig(object):
                 raise DiamondConfigError('Invalid port number: ' + port)
             self.cache_server = (host, port)
 
+        # Check the attribute cache compression method
+        if self.cache_compression is not None:
+            module = {
+                'lz4': 'lz4.frame',
+                'zstd': 'zstandard',
+                'zlib': 'zlib',
+            }.get(self.cache_compression)
+            if module is None:
+                raise DiamondConfigError('Unknown cache compression method: '
+                                         + self.cache_compression)
+            try:
+                importlib.import_module(module)
+            except ImportError:
+                raise DiamondConfigError("Couldn't load %s for cache "
+                                         "compression" % module)
+
+        # Check the CPU placement policy
+        if self.cpu_placement not in PLACEMENT_POLICIES:
+            raise DiamondConfigError('Unknown CPU placement policy: '
+                                     + self.cpu_placement)
+
         # Canonicalize debug options
         self.debug_filters = set(self.debug_filters)
         self.debug_command = self.debug_command.split(None)
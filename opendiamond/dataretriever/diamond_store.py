@@ -12,20 +12,38 @@
 
 import os
 import datetime
+import logging
+import mmap
+import struct
+from array import array
+from tempfile import mkstemp
 from xml.sax.saxutils import quoteattr
 
 from flask import Blueprint, url_for, Response, stream_with_context, send_file, \
-    jsonify
+    jsonify, request, abort
 from werkzeug.datastructures import Headers
 from werkzeug.security import safe_join
 
-from opendiamond.dataretriever.util import ATTR_SUFFIX
+from opendiamond.dataretriever.util import (
+    ATTR_SUFFIX, SCOPE_BINARY_MAGIC, SCOPE_BINARY_TYPE, binary_scope_count,
+    binary_scope_end, binary_scope_object, parse_scope_slice,
+    wants_binary_scope)
 
 BASEURL = 'collection'
 STYLE = False
 LOCAL_OBJ_URI = True  # if true, return local file path, otherwise http.
 INDEXDIR = DATAROOT = None
 
+# Sidecar stored next to each GIDIDX file, in native byte order: a header
+# with the entry count and the size and mtime of the index it describes,
+# then count + 1 line offsets, then a bitmap of entries with attribute
+# files.  It is rebuilt when the index changes.
+INDEX_SIDECAR_SUFFIX = '.idx'
+_SIDECAR_MAGIC = b'DIX1'
+_SIDECAR_HEADER = struct.Struct('=4s4xQQQ')
+
+_log = logging.getLogger(__name__)
+
 
 def init(config):
     global INDEXDIR, DATAROOT  # pylint: disable=global-statement
@@ -36,38 +54,149 @@ def init(config):
 scope_blueprint = Blueprint('diamond_store', __name__)
 
 
+class _ScopeIndex(object):
+    '''A GIDIDX file and its sidecar, both memory-mapped.'''
+
+    def __init__(self, index):
+        st = os.stat(index)
+        self._data = _map_file(index)
+        sidecar = self._load_sidecar(index + INDEX_SIDECAR_SUFFIX, st)
+        if sidecar is None:
+            sidecar = self._build_sidecar(index, st)
+        self.count = _SIDECAR_HEADER.unpack_from(sidecar)[1]
+        view = memoryview(sidecar)
+        pos = _SIDECAR_HEADER.size
+        self._offsets = view[pos:pos + 8 * (self.count + 1)].cast('Q')
+        self._bitmap = view[pos + 8 * (self.count + 1):]
+
+    @staticmethod
+    def _load_sidecar(path, st):
+        try:
+            sidecar = _map_file(path)
+        except (IOError, OSError):
+            return None
+        if len(sidecar) < _SIDECAR_HEADER.size:
+            return None
+        magic, count, size, mtime = _SIDECAR_HEADER.unpack_from(sidecar)
+        if (magic != _SIDECAR_MAGIC or size != st.st_size or
+                mtime != st.st_mtime_ns or len(sidecar) !=
+                _SIDECAR_HEADER.size + 8 * (count + 1) + (count + 7) // 8):
+            return None
+        return sidecar
+
+    @staticmethod
+    def _build_sidecar(index, st):
+        offsets = array('Q', [0])
+        bitmap = bytearray()
+        with open(index, 'rb') as f:
+            for i, line in enumerate(f):
+                if not i & 7:
+                    bitmap.append(0)
+                path = _get_obj_absolute_path(line.strip().decode())
+                if path is not None and os.path.isfile(path + ATTR_SUFFIX):
+                    bitmap[i >> 3] |= 1 << (i & 7)
+                offsets.append(offsets[-1] + len(line))
+        sidecar = (_SIDECAR_HEADER.pack(_SIDECAR_MAGIC, len(offsets) - 1,
+                                        st.st_size, st.st_mtime_ns) +
+                   offsets.tobytes() + bytes(bitmap))
+        # Replace the sidecar atomically; if we can't, use it just for
+        # this request
+        try:
+            fd, name = mkstemp(suffix=INDEX_SIDECAR_SUFFIX + '-tmp',
+                               prefix='diamond-',
+                               dir=os.path.dirname(index))
+            try:
+                with os.fdopen(fd, 'wb') as f:
+                    f.write(sidecar)
+                os.chmod(name, 0o644)
+                os.rename(name, index + INDEX_SIDECAR_SUFFIX)
+            except BaseException:
+                os.unlink(name)
+                raise
+        except (IOError, OSError) as e:
+            _log.warning('Cannot write index sidecar for %s: %s', index, e)
+        return sidecar
+
+    def entries(self, start=0, stop=None, step=1):
+        '''Yield (object path, whether it has an attribute file) for a
+        slice of the index.'''
+        offsets, bitmap = self._offsets, self._bitmap
+        for i in range(self.count)[start:stop:step]:
+            yield (self._data[offsets[i]:offsets[i + 1]].strip().decode(),
+                   bool(bitmap[i >> 3] & (1 << (i & 7))))
+
+
+def _map_file(path):
+    with open(path, 'rb') as f:
+        if not os.fstat(f.fileno()).st_size:
+            # Can't map an empty file
+            return b''
+        return mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+
 @scope_blueprint.route('/<gididx>')
 @scope_blueprint.route('/<gididx>/limit/<int:limit>')
 def get_scope(gididx, limit=None):
+    """
+    query string:
+    slice=1:2000:3  start, stop, step get a slice of all data. default=::
+    distribute=2of8     distribute to the 2nd server out of 8. (1-index). default=1of1
+    """
     index = 'GIDIDX' + gididx.upper()
     index = _get_index_absolute_path(index)
 
+    try:
+        start, stop, step = parse_scope_slice(request.args)
+    except ValueError:
+        abort(400)
+
+    def get_entries():
+        scope_index = _ScopeIndex(index)
+        num_entries = len(range(scope_index.count)[start:stop:step])
+        if limit is not None:
+            num_entries = min(num_entries, limit)
+        entries = scope_index.entries(start, stop, step)
+        return num_entries, (next(entries) for _ in range(num_entries))
+
     # Streaming response:
     # http://flask.pocoo.org/docs/0.12/patterns/streaming/
     def generate():
-        num_entries = 0
-        with open(index, 'r') as f:
-            for _ in f.readlines():
-                num_entries += 1
-                if limit is not None and num_entries >= limit:
-                    break
-
-        with open(index, 'r') as f:
-            yield '<?xml version="1.0" encoding="UTF-8" ?>\n'
-            if STYLE:
-                yield '<?xml-stylesheet type="text/xsl" href="/scopelist.xsl" ?>\n'
-
-            yield '<objectlist count="{:d}">\n'.format(num_entries)
-            
-            count = 0
-            for path in f.readlines():
-                path = path.strip()
-                yield _get_object_element(object_path=path) + '\n'
-                count += 1
-                if limit is not None and count >= limit:
-                    break
-
-            yield '</objectlist>\n'
+        num_entries, entries = get_entries()
+
+        yield '<?xml version="1.0" encoding="UTF-8" ?>\n'
+        if STYLE:
+            yield '<?xml-stylesheet type="text/xsl" href="/scopelist.xsl" ?>\n'
+
+        yield '<objectlist count="{:d}">\n'.format(num_entries)
+
+        for path, has_meta in entries:
+            yield _get_object_element(object_path=path,
+                                      has_meta=has_meta) + '\n'
+
+        yield '</objectlist>\n'
+
+    def generate_binary():
+        num_entries, entries = get_entries()
+
+        yield SCOPE_BINARY_MAGIC
+        # The count is sent up front, as for XML, so that clients can
+        # show search progress
+        yield binary_scope_count(num_entries)
+        # Batch records to limit per-chunk overhead
+        batch = []
+        for path, has_meta in entries:
+            batch.append(binary_scope_object(
+                **_get_object_attrs(path, has_meta=has_meta)))
+            if len(batch) == 256:
+                yield b''.join(batch)
+                batch = []
+        batch.append(binary_scope_end())
+        yield b''.join(batch)
+
+    if wants_binary_scope(request):
+        return Response(stream_with_context(generate_binary()),
+                        status="200 OK",
+                        headers=Headers([('Content-Type', SCOPE_BINARY_TYPE)]))
 
     headers = Headers([('Content-Type', 'text/xml')])
 
@@ -99,18 +228,30 @@ def get_object_meta(object_path):
     return jsonify(attrs)
 
 
-def _get_object_element(object_path):
-    path = _get_obj_absolute_path(object_path)
+def _get_object_attrs(object_path, has_meta=None):
+    if has_meta is None:
+        path = _get_obj_absolute_path(object_path)
+        has_meta = os.path.isfile(path + ATTR_SUFFIX)
+
+    attrs = {
+        'id': url_for('.get_object_id', object_path=object_path),
+        'src': _get_object_src_uri(object_path),
+    }
+    if has_meta:
+        attrs['meta'] = url_for('.get_object_meta', object_path=object_path)
+    return attrs
+
+
+def _get_object_element(object_path, has_meta=None):
+    attrs = _get_object_attrs(object_path, has_meta=has_meta)
 
-    if os.path.isfile(path + ATTR_SUFFIX):
+    if 'meta' in attrs:
         return '<object id={} src={} meta={} />' \
-            .format(quoteattr(url_for('.get_object_id', object_path=object_path)),
-                    quoteattr(_get_object_src_uri(object_path)),
-                    quoteattr(url_for('.get_object_meta', object_path=object_path)))
+            .format(quoteattr(attrs['id']), quoteattr(attrs['src']),
+                    quoteattr(attrs['meta']))
     else:
         return '<object id={} src={} />' \
-            .format(quoteattr(url_for('.get_object_id', object_path=object_path)),
-                    quoteattr(_get_object_src_uri(object_path)))
+            .format(quoteattr(attrs['id']), quoteattr(attrs['src']))
 
 
 def _get_object_src_uri(object_path):
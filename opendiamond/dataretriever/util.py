@@ -18,11 +18,17 @@ import pwd
 import grp
 import random
 import re
+import struct
 import sys
 from tempfile import mkstemp
 
 ATTR_SUFFIX = '.text_attr'
 
+# Compact scope list format, sent instead of XML when the Diamond server's
+# Accept header allows it.  See opendiamond.server.scopelist.
+SCOPE_BINARY_TYPE = 'application/x-diamond-scope'
+SCOPE_BINARY_MAGIC = b'DSC1'
+
 _log = logging.getLogger(__name__)
 
 class DiamondTextAttr(object):
@@ -74,6 +80,59 @@ class DiamondTextAttr(object):
         return os.path.isfile(path + suffix)
 
 
+def parse_scope_slice(args):
+    '''Return (start, stop, step) for the slice and distribute query
+    string arguments of a scope request:
+
+    slice=1:2000:3  start, stop, step get a slice of all data. default=::
+    distribute=2of8     distribute to the 2nd server out of 8. (1-index). default=1of1
+
+    Raise ValueError if they are invalid.'''
+    slice_str = args.get('slice', '::')
+    start, stop, step = [int(x) if x else None for x in slice_str.split(':')[:3]]
+    start = start or 0
+    step = step or 1
+    distribute_str = args.get('distribute', '1of1')
+    n, m = list(map(int, distribute_str.split('of')[:2]))
+    if start < 0 or (stop is not None and stop < 0) or step <= 0 or \
+            not 1 <= n <= m:
+        raise ValueError('Invalid slice %s or distribute %s' %
+                         (slice_str, distribute_str))
+    # manipulate start, step to incorporate distribute params
+    start += (n-1) * step
+    step *= m
+    return start, stop, step
+
+
+def wants_binary_scope(request):
+    '''Return True if the Flask request accepts binary scope lists.'''
+    return request.accept_mimetypes.best_match(
+        ['text/xml', SCOPE_BINARY_TYPE]) == SCOPE_BINARY_TYPE
+
+
+def _scope_record(type_, payload):
+    return struct.pack('>cI', type_, len(payload)) + payload
+
+
+def binary_scope_count(adjust):
+    '''Return a binary scope list record adjusting the object count.'''
+    return _scope_record(b'C', struct.pack('>q', adjust))
+
+
+def binary_scope_object(**attrs):
+    '''Return a binary scope list record for an object with the given
+    attributes (id, src, meta, ...), which are str and must not contain
+    NUL characters.'''
+    payload = b''.join(k.encode() + b'\0' + v.encode() + b'\0'
+                       for k, v in attrs.items() if v is not None)
+    return _scope_record(b'O', payload)
+
+
+def binary_scope_end():
+    '''Return the record ending a binary scope list.'''
+    return _scope_record(b'E', b'')
+
+
 def read_file_list(path):
     sys.stdout.flush()
     if not os.path.exists(path):
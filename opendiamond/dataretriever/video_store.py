@@ -12,11 +12,17 @@
 from builtins import range, str
 
 import datetime
+import hashlib
 import json
+import logging
 import os
 import subprocess
 import sys
+import threading
+from collections import OrderedDict
+from concurrent import futures
 from math import ceil
+from tempfile import mkstemp
 
 from flask import Blueprint, Response, request, stream_with_context, url_for
 from opendiamond.dataretriever.util import DiamondTextAttr
@@ -28,12 +34,173 @@ from werkzeug.security import safe_join
 BASEURL = 'video'
 STYLE = False
 INDEXDIR = DATAROOT = None
+PREFETCH = 0
+_video_index = _segment_cache = None
+
+_log = logging.getLogger(__name__)
 
 
 def init(config):
-    global INDEXDIR, DATAROOT  # pylint: disable=global-statement
+    global INDEXDIR, DATAROOT, PREFETCH  # pylint: disable=global-statement
+    global _video_index, _segment_cache  # pylint: disable=global-statement
     INDEXDIR = config.indexdir
     DATAROOT = config.dataroot
+    PREFETCH = config.video_prefetch
+    _video_index = _VideoIndex(
+        os.path.join(config.video_cachedir, 'durations.json'))
+    _segment_cache = _SegmentCache(
+        os.path.join(config.video_cachedir, 'segments'),
+        config.video_cache_size << 20, config.video_workers)
+
+
+class _VideoIndex(object):
+    '''Persistent video durations, so that each video is probed once
+    rather than on every scope request.'''
+
+    def __init__(self, path):
+        self._path = path
+        self._lock = threading.Lock()
+        # video path -> [size, mtime, duration]
+        try:
+            with open(path) as f:
+                self._entries = json.load(f)
+        except (IOError, ValueError):
+            self._entries = {}
+
+    def duration(self, video_path):
+        st = os.stat(video_path)
+        key = [st.st_size, st.st_mtime]
+        with self._lock:
+            entry = self._entries.get(video_path)
+        if entry is not None and entry[:2] == key:
+            return entry[2]
+        duration = float(_ffprobe(video_path)['format']['duration'])
+        with self._lock:
+            self._entries[video_path] = key + [duration]
+            try:
+                self._save()
+            except (IOError, OSError) as e:
+                _log.warning('Cannot save video index: %s', e)
+        return duration
+
+    def _save(self):
+        '''self._lock must be held.'''
+        fd, name = mkstemp(suffix='-tmp', prefix='diamond-',
+                           dir=os.path.dirname(self._path))
+        try:
+            with os.fdopen(fd, 'w') as f:
+                json.dump(self._entries, f)
+            os.rename(name, self._path)
+        except BaseException:
+            os.unlink(name)
+            raise
+
+
+class _SegmentCache(object):
+    '''On-disk LRU cache of extracted segments, filled by a bounded pool
+    of ffmpeg processes.'''
+
+    def __init__(self, cachedir, max_bytes, workers):
+        self._dir = cachedir
+        self._max_bytes = max_bytes
+        self._workers = workers
+        self._pool = futures.ThreadPoolExecutor(workers)
+        self._lock = threading.Lock()
+        # file name -> size, least recently used first
+        self._files = OrderedDict()
+        self._size = 0
+        # file name -> Future of segments being extracted
+        self._pending = {}
+        if not os.path.isdir(cachedir):
+            os.makedirs(cachedir)
+        # Pick up segments from earlier runs, ordered by last use
+        entries = []
+        for name in os.listdir(cachedir):
+            path = os.path.join(cachedir, name)
+            if name.endswith('.mp4'):
+                st = os.stat(path)
+                entries.append((st.st_mtime, name, st.st_size))
+            elif name.endswith('-tmp'):
+                os.unlink(path)
+        for _, name, size in sorted(entries):
+            self._files[name] = size
+            self._size += size
+
+    @staticmethod
+    def _name(video_path, start, span):
+        st = os.stat(video_path)
+        key = '{}\0{}\0{}\0{}\0{}'.format(video_path, st.st_size,
+                                            st.st_mtime, start, span)
+        return hashlib.sha1(key.encode()).hexdigest() + '.mp4'
+
+    def _submit(self, name, video_path, start, span):
+        '''self._lock must be held.'''
+        future = self._pending.get(name)
+        if future is None:
+            future = self._pool.submit(self._extract, name, video_path,
+                                       start, span)
+            self._pending[name] = future
+        return future
+
+    def _extract(self, name, video_path, start, span):
+        path = os.path.join(self._dir, name)
+        try:
+            fd, tmp = mkstemp(suffix='-tmp', prefix='diamond-', dir=self._dir)
+            try:
+                with os.fdopen(fd, 'wb') as f:
+                    proc = _create_ffmpeg_segment_proc(
+                        video_path, start_sec=start, duration_sec=span,
+                        stdout=f)
+                    status = proc.wait()
+                if status:
+                    raise IOError('ffmpeg exited with status %d' % status)
+                size = os.stat(tmp).st_size
+                os.rename(tmp, path)
+            except BaseException:
+                os.unlink(tmp)
+                raise
+        except BaseException:
+            with self._lock:
+                del self._pending[name]
+            raise
+        evicted = []
+        with self._lock:
+            del self._pending[name]
+            self._files[name] = size
+            self._size += size
+            # Never evict the new segment, so that its requester can open it
+            while self._size > self._max_bytes and len(self._files) > 1:
+                old, old_size = self._files.popitem(last=False)
+                self._size -= old_size
+                evicted.append(old)
+        for old in evicted:
+            os.unlink(os.path.join(self._dir, old))
+
+    def open(self, video_path, start, span):
+        '''Return an open file containing the segment, extracting it if
+        necessary.'''
+        name = self._name(video_path, start, span)
+        path = os.path.join(self._dir, name)
+        while True:
+            with self._lock:
+                if name in self._files:
+                    self._files.move_to_end(name)
+                    # Record the use for ordering after a restart
+                    os.utime(path, None)
+                    return open(path, 'rb')
+                future = self._submit(name, video_path, start, span)
+            future.result()
+
+    def prefetch(self, video_path, starts, span):
+        '''Start extracting segments expected to be requested soon, unless
+        the workers are already busy.'''
+        with self._lock:
+            for start in starts:
+                if len(self._pending) >= 2 * self._workers:
+                    break
+                name = self._name(video_path, start, span)
+                if name not in self._files:
+                    self._submit(name, video_path, start, span)
 
 
 scope_blueprint = Blueprint('video_store', __name__)
@@ -55,12 +222,12 @@ def get_scope(gididx, stride=5, span=5):
                 video = line.strip()
                 video_path = str(_get_obj_absolute_path(video))
                 try:
-                    video_meta = _ffprobe(video_path)
-                    length_sec = float(video_meta['format']['duration'])
+                    length_sec = _video_index.duration(video_path)
                     num_clips = int(ceil(length_sec / stride))
                     yield '<count adjust="{}"/>\n'.format(num_clips)
                     for clip in range(num_clips):
-                        yield _get_object_element(start=clip * stride, span=span, video=video) + '\n'
+                        yield _get_object_element(start=clip * stride, span=span, video=video,
+                                                  stride=stride) + '\n'
                 except Exception as e:
                     print("Error parsing {}. {}. Skip.".format(video, str(e)), file=sys.stderr)
                     pass
@@ -86,16 +253,24 @@ def get_object(start, span, video):
     # Reference:
     # https://github.com/mikeboers/PyAV/blob/master/tests/test_seek.py
     video_path = str(_get_obj_absolute_path(video))
-    proc = _create_ffmpeg_segment_proc(video_path,
-                                       start_sec=start,
-                                       duration_sec=span)
+    f = _segment_cache.open(video_path, start, span)
+
+    # Scope lists include the stride, so that we can extract the next
+    # segments while the client processes this one
+    stride = request.args.get('stride', type=int)
+    if stride is not None and stride > 0 and PREFETCH > 0:
+        length_sec = _video_index.duration(video_path)
+        starts = [start + i * stride for i in range(1, PREFETCH + 1)]
+        _segment_cache.prefetch(video_path,
+                                [s for s in starts if s < length_sec], span)
 
     def generate():
-        while True:
-            data = proc.stdout.read(4096)
-            if not data:
-                break
-            yield data
+        with f:
+            while True:
+                data = f.read(65536)
+                if not data:
+                    break
+                yield data
 
     headers = Headers([('Content-Type', 'video/mp4')])
     response = Response(stream_with_context(generate()),
@@ -116,10 +291,11 @@ def get_object(start, span, video):
     return response
 
 
-def _get_object_element(start, span, video):
+def _get_object_element(start, span, video, stride=None):
     return '<object id="{}" src="{}" />'.format(
         url_for('.get_object_id', start=start, span=span, video=video),
-        url_for('.get_object', start=start, span=span, video=video))
+        url_for('.get_object', start=start, span=span, video=video,
+                stride=stride))
 
 
 def _get_obj_absolute_path(obj_path):
@@ -140,7 +316,8 @@ def _ffprobe(video_path):
     return data
 
 
-def _create_ffmpeg_segment_proc(video_path, start_sec, duration_sec):
+def _create_ffmpeg_segment_proc(video_path, start_sec, duration_sec,
+                                stdout=subprocess.PIPE):
     """
     Use ffmpeg to extract a .mp4 segment of the video. Outfile is written to stdout.
     Note: requires ffmpeg >= 3.3. Lower versions produce wrong results.
@@ -149,6 +326,7 @@ def _create_ffmpeg_segment_proc(video_path, start_sec, duration_sec):
     :param video_path:
     :param start_sec:
     :param duration_sec:
+    :param stdout: where to write the segment
     :return: the subprocess
     """
     cmd_l = ['ffmpeg', '-v', 'quiet',
@@ -160,5 +338,5 @@ def _create_ffmpeg_segment_proc(video_path, start_sec, duration_sec):
              '-f', 'mp4',
              'pipe:1']
 
-    proc = subprocess.Popen(cmd_l, stdout=subprocess.PIPE, bufsize=-1)
+    proc = subprocess.Popen(cmd_l, stdout=stdout, bufsize=-1)
     return proc
@@ -12,7 +12,6 @@
 
 from future import standard_library
 standard_library.install_aliases()
-from builtins import map
 import datetime
 from flask import abort, Blueprint, jsonify, \
     send_file, stream_with_context, request, Response, url_for
@@ -23,6 +22,8 @@ import urllib.parse
 from xml.sax.saxutils import quoteattr
 from werkzeug.datastructures import Headers
 
+from opendiamond.dataretriever.util import parse_scope_slice
+
 BASEURL = 'yfcc100m_simple'
 
 INDEXDIR = DATAROOT = None
@@ -50,22 +51,10 @@ def get_scope():
     meta_file = os.path.join(DATAROOT, 'yfcc100m', 'yfcc100m.csv')
 
     try:
-        # process query string args
-        slice_str = request.args.get('slice', '::')
-        start, stop, step = [int(x) if x else None for x in slice_str.split(':')[:3]]
-        start = start or 0
-        step = step or 1
-        distribute_str = request.args.get('distribute', '1of1')
-        n, m = list(map(int, distribute_str.split('of')[:2]))
-        assert step > 0
-        assert 1 <= n <= m
-        # manipulate start, step to incorporate distribute params
-        start += (n-1) * step
-        step *= m
-    except:
+        start, stop, step = parse_scope_slice(request.args)
+    except ValueError:
         abort(400)
 
-    _log.debug("slice=%s; distribute=%s", slice_str, distribute_str)
     _log.info("Adjusted slice: start=%s stop=%s step=%s", start, stop, step)
 
     def generate():
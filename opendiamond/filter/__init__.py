@@ -324,6 +324,7 @@ class Object(object):
         self._attrs = dict(attrs)
         self._valid = True
         self._image = None
+        self._deadline = None
 
     def get_binary(self, key):
         '''Get the specified object attribute as raw binary data.'''
@@ -435,6 +436,20 @@ class Object(object):
             self._image = self.get_rgbimage('_rgb_image.rgbimage')
         return self._image
 
+    def deadline_exceeded(self):
+        '''Return True if the filter has used up its time budget for this
+        object.  Long-running filters should check this periodically and
+        return early, since Diamond kills filters which keep working well
+        past the budget.'''
+        self.check_valid()
+        if self._deadline is None:
+            remaining = self._get_remaining_time()
+            if remaining is None:
+                self._deadline = float('inf')
+            else:
+                self._deadline = time.time() + remaining
+        return time.time() >= self._deadline
+
     def omit(self, key):
         '''Tell Diamond not to send the specified attribute back to the
         client by default.  Raises KeyError if the attribute does not exist.'''
@@ -460,6 +475,9 @@ class Object(object):
         if key not in self._attrs:
             raise KeyError()
 
+    def _get_remaining_time(self):
+        return None
+
 
 class _DiamondObject(Object):
     '''A Diamond object to be evaluated.'''
@@ -480,6 +498,13 @@ class _DiamondObject(Object):
         if not self._conn.get_boolean():
             raise KeyError()
 
+    def _get_remaining_time(self):
+        self._conn.send_message('get-deadline')
+        remaining = self._conn.get_item()
+        if remaining is None:
+            return None
+        return float(remaining)
+
 
 class _DiamondConnection(object):
     '''Proxy object for the stdin/stdout protocol connection with the
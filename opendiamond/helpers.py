@@ -16,18 +16,28 @@ standard_library.install_aliases()
 from builtins import str
 from builtins import range
 from builtins import object
+import array
 from ctypes import cdll, c_char_p, c_int
 import logging
 import mmh3
 import os
 import resource
 import signal
+import socket
 import sys
 from threading import Lock
 from urllib.parse import urlparse
 
+try:
+    from opendiamond._murmur import hexdigest as _murmur_hexdigest
+except ImportError:
+    _murmur_hexdigest = None
+
 _log = logging.getLogger(__name__)
 
+# The first 10 digits of pi
+MURMUR_SEED = 0xbb40e64d
+
 
 # We use os._exit() to avoid calling destructors after fork()
 # pylint: disable=protected-access
@@ -52,6 +62,25 @@ def daemonize():
 # pylint: enable=protected-access
 
 
+def send_fds(sock, data, fds):
+    '''Send data and a list of file descriptors over a Unix socket.
+    socket.send_fds() needs Python 3.9.'''
+    return sock.sendmsg([data], [(socket.SOL_SOCKET, socket.SCM_RIGHTS,
+                                  array.array('i', fds))])
+
+
+def recv_fds(sock, bufsize, maxfds):
+    '''Receive data and up to maxfds file descriptors from a Unix socket.
+    Return (data, list of fds).'''
+    fds = array.array('i')
+    data, ancdata, _flags, _addr = sock.recvmsg(
+        bufsize, socket.CMSG_LEN(maxfds * fds.itemsize))
+    for level, type_, cdata in ancdata:
+        if level == socket.SOL_SOCKET and type_ == socket.SCM_RIGHTS:
+            fds.frombytes(cdata[:len(cdata) - len(cdata) % fds.itemsize])
+    return data, list(fds)
+
+
 def signalname(signum):
     '''Return the name for the specified signal number.'''
     for attr in dir(signal):
@@ -64,8 +93,13 @@ def signalname(signum):
 def murmur(data):
     '''Return a lower-case hex string representing the MurmurHash3-x64-128
     hash of the specified data using the seed 0xbb40e64d (the first 10
-    digits of pi, in hex).'''
-    return mmh3.hash_bytes(data, 314159).hex()
+    digits of pi, in hex).  Uses the native implementation if it was built,
+    which accepts any buffer without copying.'''
+    if _murmur_hexdigest is not None:
+        return _murmur_hexdigest(data, MURMUR_SEED)
+    if isinstance(data, memoryview):
+        data = data.tobytes()
+    return mmh3.hash_bytes(data, MURMUR_SEED).hex()
 
 
 class _TcpWrappers(object):
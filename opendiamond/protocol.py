@@ -16,7 +16,12 @@
 # pylint: disable=invalid-name
 
 from opendiamond.rpc import RPCError
-from opendiamond.xdr import XDR, XDRStruct
+from opendiamond.xdr import XDR, XDRStruct, XDREncodingError
+
+try:
+    from opendiamond import _xdr
+except ImportError:
+    _xdr = None
 
 # Default port
 PORT = 5872
@@ -54,11 +59,65 @@ class XDR_attribute(XDRStruct):
 
 
 class XDR_object(XDRStruct):
-    '''Blast channel object data'''
+    '''Blast channel object data.  Uses the native codec if it was built,
+    and can be built from (name, value) pairs without creating an
+    XDR_attribute for each.'''
     members = (
         'attrs', XDR.array(XDR.struct(XDR_attribute)),
     )
 
+    _attrs = None
+    _pairs = None
+
+    @classmethod
+    def from_pairs(cls, pairs):
+        '''Return an XDR_object for a list of (name, value) pairs.  Values
+        may be bytes or memoryviews.'''
+        obj = cls()
+        obj._pairs = pairs
+        return obj
+
+    @property
+    def attrs(self):
+        if self._attrs is None and self._pairs is not None:
+            self._attrs = [
+                XDR_attribute(name, value.tobytes()
+                              if isinstance(value, memoryview) else value)
+                for name, value in self._pairs]
+        return self._attrs
+
+    @attrs.setter
+    def attrs(self, value):
+        self._attrs = value
+        self._pairs = None
+
+    def encode(self):
+        if _xdr is None:
+            return XDRStruct.encode(self)
+        return b''.join(self.encode_segments())
+
+    def encode_segments(self):
+        if _xdr is None:
+            return XDRStruct.encode_segments(self)
+        if self._pairs is not None:
+            pairs = self._pairs
+        else:
+            pairs = [(attr.name, attr.value) for attr in self.attrs]
+        try:
+            return _xdr.pack_attributes(pairs)
+        except (TypeError, ValueError):
+            raise XDREncodingError()
+
+    @classmethod
+    def decode(cls, data):
+        if _xdr is None:
+            return super(XDR_object, cls).decode(data)
+        try:
+            pairs = _xdr.unpack_attributes(data)
+        except (TypeError, ValueError):
+            raise XDREncodingError()
+        return cls([XDR_attribute(name, value) for name, value in pairs])
+
 
 class XDR_blob_list(XDRStruct):
     '''A list of blob URIs'''
@@ -149,6 +208,31 @@ class XDR_reexecute(XDRStruct):
         'attrs', XDR.optional(XDR.array(XDR.string())),
     )
 
+class XDR_reexecute_batch(XDRStruct):
+    '''Batch reexecute argument'''
+    members = (
+        'object_ids', XDR.array(XDR.string()),
+        'attrs', XDR.optional(XDR.array(XDR.string())),
+    )
+
+
+class XDR_reexecute_result(XDRStruct):
+    '''Reexecution result for one object of a batch.  status is 0 or an
+    RPC error code.'''
+    members = (
+        'object_id', XDR.string(),
+        'status', XDR.int(),
+        'attrs', XDR.array(XDR.struct(XDR_attribute)),
+    )
+
+
+class XDR_reexecute_results(XDRStruct):
+    '''Batch reexecute response'''
+    members = (
+        'results', XDR.array(XDR.struct(XDR_reexecute_result)),
+    )
+
+
 class XDR_retrain(XDRStruct):
     '''Search retrain parameters'''
     members = (
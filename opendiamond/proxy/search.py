@@ -63,12 +63,23 @@ dropped_count = 0
 true_dropped = 0
 stats_lock = threading.Lock()
 
+# Largest number of objects scored by the proxy model at once
+PROXY_BATCH_SIZE = 64
+# Longest time to wait for more objects once a batch has been started
+PROXY_BATCH_LATENCY = 0.02  # seconds
+# Feature vector attributes: packed little-endian float32 values, or a
+# JSON list of numbers
+ATTR_FEATURES_F32 = 'feature_vector.f32'
+ATTR_FEATURES_JSON = 'feature_vector.json'
+
 class ProxySearch(RPCHandlers):
     '''State for a single search, plus handlers for control channel RPCs
     to modify it.'''
 
     log_rpcs = True
-    running = False
+    # Set while the search is running and not being retrained; blast
+    # threads wait on it
+    search_running = threading.Event()
 
     def __init__(self, blast_conn, docker_address):
         RPCHandlers.__init__(self)
@@ -95,7 +106,7 @@ class ProxySearch(RPCHandlers):
         '''Clean up the search before the process exits.'''
 
         # Clean up the resource context before terminate() to avoid corrupting the shared data structures.
-        ProxySearch.running = False
+        ProxySearch.search_running.clear()
         if self._connections:
             for c in self._connections.values():
                 c.close()
@@ -294,7 +305,7 @@ class ProxySearch(RPCHandlers):
         _log.info('Push attributes:u%s',
                   ','.join(
                       params.attrs) if params.attrs else '(everything)')
-        ProxySearch.running = True
+        ProxySearch.search_running.set()
         self._running = True
         search_id = str(uuid.uuid4())
         for h, c in self._connections.items():
@@ -314,7 +325,7 @@ class ProxySearch(RPCHandlers):
         if not params.features[0]:
             return
 
-        ProxySearch.running = False
+        ProxySearch.search_running.clear()
         #ReTrainFilters
         self.proxy_filter.addItemList(params)
         self.proxy_filter.trainEnsemble()
@@ -324,7 +335,7 @@ class ProxySearch(RPCHandlers):
             proxy_model = new_model
             print("New model created of Length:{}".format(len(proxy_model)))
 
-        ProxySearch.running = True
+        ProxySearch.search_running.set()
         return
 
     @RPCHandlers.handler(30, protocol.XDR_reexecute,
@@ -420,9 +431,18 @@ class _DiamondBlastSet(RPCHandlers):
         # Connections that have not finished searching
         self._conn = conn
         self._connections = set(connections)
+        # Objects received from the connections, not yet scored
         self.pending_objs = deque()
+        # Signaled when objects are added to pending_objs
+        self._pending_cond = threading.Condition()
+        # Scored objects waiting to be returned to the client
+        self._ready_objs = deque()
         self.pending_conns = deque()
+        # Outstanding client requests; connections only fetch results
+        # while there are some
         self.pending_reqs = deque()
+        # Signaled when requests are added to pending_reqs
+        self._req_cond = threading.Condition()
         self._started = False
         self.running = False
         self.high_conf = protocol.XDR_attribute("_score.string", (str(1)+ '\0').encode())
@@ -431,91 +451,149 @@ class _DiamondBlastSet(RPCHandlers):
         self.setup_requests()
 
     def setup_requests(self):
-        for _ in range(len(self._connections)):
-            self.pending_reqs.append(1)
+        with self._req_cond:
+            for _ in range(len(self._connections)):
+                self.pending_reqs.append(1)
+            self._req_cond.notify_all()
+
+    def reset_requests(self):
+        with self._req_cond:
+            self.pending_reqs.clear()
+            self.setup_requests()
 
     def queue_empty(self):
-        return not self.pending_objs
+        return not self.pending_objs and not self._ready_objs
+
+    def add_object(self, obj):
+        with self._pending_cond:
+            self.pending_objs.append(obj)
+            self._pending_cond.notify()
+
+    def clear_objects(self):
+        with self._pending_cond:
+            self.pending_objs.clear()
+            self._ready_objs.clear()
 
     def add_request(self):
-        self.pending_reqs.append(1)
+        with self._req_cond:
+            self.pending_reqs.append(1)
+            self._req_cond.notify_all()
 
     def decrease_request(self):
-        if self.pending_reqs:
-            self.pending_reqs.popleft()
+        with self._req_cond:
+            if self.pending_reqs:
+                self.pending_reqs.popleft()
 
-    def get_prediction(self, features):
-        global proxy_model
+    def wait_request(self):
+        """Wait until there is an outstanding client request."""
+        with self._req_cond:
+            while not self.pending_reqs:
+                self._req_cond.wait()
 
+    @staticmethod
+    def get_prediction(models, features):
+        """Return the mean positive-class probability of the ensemble for
+        each row of features."""
         #Assuming num_classes = 2
         #Ideally can find num_classes for the max index of model.classes_
         num_classes = 2
 
-        with model_lock:
-            num_models = len(proxy_model)
-            num_items = features.shape[0]
-
-            pred_proba_list = np.zeros((num_items, num_classes, num_models))
-            for j, m in enumerate(proxy_model):
-                pred = m.predict_proba(features)
-                pred_proba_list[:,m.classes_,j] = pred
-            pred_mean = np.mean(pred_proba_list, axis =-1)
-            return pred_mean[:,1]
+        num_models = len(models)
+        num_items = features.shape[0]
 
-    def fetch_object(self):
-        global proxy_model
-        while True:
+        pred_proba_list = np.zeros((num_items, num_classes, num_models))
+        for j, m in enumerate(models):
+            pred = m.predict_proba(features)
+            pred_proba_list[:,m.classes_,j] = pred
+        pred_mean = np.mean(pred_proba_list, axis =-1)
+        return pred_mean[:,1]
 
+    @staticmethod
+    def _get_features(obj):
+        """Return the feature vector of an object as a float32 array, or
+        None if it has none."""
+        features = None
+        for a in obj.attrs:
+            if a.name == ATTR_FEATURES_F32:
+                return np.frombuffer(a.value, dtype='<f4')
+            if a.name == ATTR_FEATURES_JSON:
+                features = a.value
+        if features is None:
+            return None
+        return np.array(json.loads(features), dtype=np.float32)
+
+    def _get_batch(self, size):
+        """Wait for pending objects and return up to size of them, waiting
+        at most PROXY_BATCH_LATENCY after the first arrives for the batch
+        to fill."""
+        with self._pending_cond:
             while not self.pending_objs:
-                pass #wait till present
-
-            obj = self.pending_objs.popleft()
-
-            with model_lock:
-                if not proxy_model:
-                    return obj
-
-            gt_present = False
-            features = None
-            for a in obj.attrs:
-                if a.name == "feature_vector.json":
-                    features = np.array([json.loads(a.value)])
-                if a.name == "_gt_label":
-                    gt_present = True
+                self._pending_cond.wait()
+            deadline = time.time() + PROXY_BATCH_LATENCY
+            while len(self.pending_objs) < size:
+                remaining = deadline - time.time()
+                if remaining <= 0:
+                    break
+                self._pending_cond.wait(remaining)
+            count = min(len(self.pending_objs), size)
+            return [self.pending_objs.popleft() for _ in range(count)]
+
+    def _score_batch(self, models, objs):
+        """Score a batch of objects, appending those to be sent to the
+        client to _ready_objs."""
+        # Stack feature vectors by length so that each group is scored
+        # with one predict_proba() call per model
+        groups = defaultdict(list)
+        for obj in objs:
+            features = self._get_features(obj)
             if features is None:
-                return obj
-
-            pred = self.get_prediction(features)
-            pred_attr = protocol.XDR_attribute("prediction.string", (str(pred)+ '\0').encode())
-            obj.attrs.append(pred_attr)
-            if pred > 0.85:
-                obj.attrs.append(self.high_conf)
-            elif pred < 0.4:
-                # only send 2% of rejected items
-                sample = np.random.uniform()
-                if gt_present:
-                    print("FN pred:{}".format(pred))
-                    #TODO Count this in FN
-                if sample > 0.02:
-                    continue
-                global dropped_count
-                with stats_lock:
-                    dropped_count += 1
-                obj.attrs.append(self.low_conf)
+                self._ready_objs.append(obj)
             else:
-                obj.attrs.append(self.mid_conf)
+                groups[len(features)].append((obj, features))
+
+        for group in groups.values():
+            preds = self.get_prediction(
+                models, np.vstack([features for _, features in group]))
+            samples = np.random.uniform(size=len(group))
+            for (obj, _), pred, sample in zip(group, preds, samples):
+                pred_attr = protocol.XDR_attribute("prediction.string", (str(pred)+ '\0').encode())
+                obj.attrs.append(pred_attr)
+                if pred > 0.85:
+                    obj.attrs.append(self.high_conf)
+                elif pred < 0.4:
+                    # only send 2% of rejected items
+                    if any(a.name == "_gt_label" for a in obj.attrs):
+                        print("FN pred:{}".format(pred))
+                        #TODO Count this in FN
+                    if sample > 0.02:
+                        continue
+                    global dropped_count
+                    with stats_lock:
+                        dropped_count += 1
+                    obj.attrs.append(self.low_conf)
+                else:
+                    obj.attrs.append(self.mid_conf)
+                self._ready_objs.append(obj)
 
-            return obj
+    def fetch_object(self):
+        while not self._ready_objs:
+            with model_lock:
+                # Models are replaced, never modified, so the snapshot can
+                # be used without holding the lock
+                models = proxy_model
+            if not models:
+                self._ready_objs.extend(self._get_batch(1))
+            else:
+                self._score_batch(models, self._get_batch(PROXY_BATCH_SIZE))
+        return self._ready_objs.popleft()
 
     @RPCHandlers.handler(2, reply_class=protocol.XDR_object)
     def get_object(self):
-        while not ProxySearch.running:
-            self.pending_objs.clear()
-            self.pending_reqs.clear()
+        if not ProxySearch.search_running.is_set():
+            self.clear_objects()
             #self._started = False
-            self.setup_requests()
-            time.sleep(2)
-            continue
+            self.reset_requests()
+            ProxySearch.search_running.wait()
 
         if not self._started:
             self.setup_requests()
@@ -544,10 +622,8 @@ class _DiamondBlastSet(RPCHandlers):
             def worker(handler):
                 try:
                     while True:
-                        if not ProxySearch.running:
-                            continue
                         obj = next(handler)
-                        self.pending_objs.append(obj)
+                        self.add_object(obj)
                 except StopIteration:
                     print("Stop request called")
                     pass
@@ -557,17 +633,16 @@ class _DiamondBlastSet(RPCHandlers):
             for conn in self._connections:
                 self.pending_conns.append(1)     # just a token
                 threading.Thread(target=worker,
-                    args=(self._handle_objects(conn,self.pending_reqs),)).start()
+                    args=(self._handle_objects(conn),)).start()
 
-    @staticmethod
-    def _handle_objects(conn, req_queue):
-        """A generator yielding search results from a DiamondConnection."""
+    def _handle_objects(self, conn):
+        """A generator yielding search results from a DiamondConnection
+        while the search is running and the client has requests
+        outstanding."""
         while True:
-            if not ProxySearch.running:
-                continue
+            ProxySearch.search_running.wait()
             try:
-                while not req_queue:
-                    pass
+                self.wait_request()
                 dct = conn.get_result()
             except ConnectionFailure:
                 break
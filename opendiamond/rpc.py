@@ -18,6 +18,7 @@ from builtins import object
 import logging
 import multiprocessing as mp
 import socket
+import struct
 import threading
 
 from opendiamond.xdr import XDR, XDRStruct, XDREncodingError
@@ -26,6 +27,10 @@ from future.utils import with_metaclass
 _log = logging.getLogger(__name__)
 
 RPC_PENDING = -1
+# Largest number of buffers passed to one sendmsg() call
+_IOV_MAX = 1024
+# Largest piece of a request body read at once by streaming handlers
+RPC_CHUNK_SIZE = 1 << 20
 
 
 class ConnectionFailure(Exception):
@@ -75,17 +80,56 @@ class RPCHeader(XDRStruct):
     )
 
 
+class RPCRequestBody(object):
+    '''The body of an RPC request, read from the connection on demand.
+    Handlers declared with streaming=True receive this instead of a decoded
+    request object, so that large requests need not be held in memory.'''
+
+    def __init__(self, read_bytes, length):
+        self._read_bytes = read_bytes
+        self.remaining = length
+
+    def read(self, count):
+        '''Return the next count bytes of the body.'''
+        if count > self.remaining:
+            raise RPCEncodingError()
+        self.remaining -= count
+        return self._read_bytes(count)
+
+    def read_uint(self):
+        '''Read an XDR unsigned int.'''
+        return struct.unpack('>I', self.read(4))[0]
+
+    def read_opaque(self, chunk_size=RPC_CHUNK_SIZE):
+        '''Read a variable-length XDR opaque, yielding its contents in
+        pieces of at most chunk_size bytes.'''
+        length = self.read_uint()
+        padding = -length % 4
+        if length + padding > self.remaining:
+            raise RPCEncodingError()
+        while length:
+            chunk = self.read(min(length, chunk_size))
+            length -= len(chunk)
+            yield chunk
+        self.read(padding)
+
+    def skip(self):
+        '''Discard the rest of the body.'''
+        while self.remaining:
+            self.read(min(self.remaining, RPC_CHUNK_SIZE))
+
+
 class _RPCRequest(object):
-    '''The header and data from an RPC request.'''
+    '''The header and body from an RPC request.'''
 
-    def __init__(self, hdr, data):
+    def __init__(self, hdr, body):
         self.hdr = hdr
-        self.data = data
+        self.body = body
 
-    def make_reply_header(self, status, data):
+    def make_reply_header(self, status, datalen):
         '''Return the header for an RPC reply.'''
         return RPCHeader(sequence=self.hdr.sequence, status=status,
-                         cmd=self.hdr.cmd, datalen=len(data))
+                         cmd=self.hdr.cmd, datalen=datalen)
 
 
 class RPCConnection(object):
@@ -95,36 +139,48 @@ class RPCConnection(object):
         self._sock = sock   # XXX may not be pickled
         self._lock = mp.Lock()
 
-    def _receive(self):
+    def _read_bytes(self, count):
         '''self._lock must be held.'''
-        def read_bytes(count):
-            bufs = []
-            try:
-                while count > 0:
-                    new = self._sock.recv(count)
-                    if not new:
-                        self._sock.close()
-                        raise ConnectionFailure('Short read')
-                    count -= len(new)
-                    bufs.append(new)
-            except socket.error as e:
-                self._sock.close()
-                raise ConnectionFailure(str(e))
-            return b''.join(bufs)
+        bufs = []
+        try:
+            while count > 0:
+                new = self._sock.recv(count)
+                if not new:
+                    self._sock.close()
+                    raise ConnectionFailure('Short read')
+                count -= len(new)
+                bufs.append(new)
+        except socket.error as e:
+            self._sock.close()
+            raise ConnectionFailure(str(e))
+        return b''.join(bufs)
 
+    def _receive(self):
+        '''Receive a request header.  The caller must read or skip the
+        body.  self._lock must be held.'''
         while True:
-            hdr = RPCHeader.decode(read_bytes(RPCHeader.ENCODED_LENGTH))
-            data = read_bytes(hdr.datalen)
+            hdr = RPCHeader.decode(self._read_bytes(RPCHeader.ENCODED_LENGTH))
+            body = RPCRequestBody(self._read_bytes, hdr.datalen)
             # We only handle request traffic; ignore reply messages
             if hdr.status == RPC_PENDING:
-                return _RPCRequest(hdr, data)
-
-    def _reply(self, request, status=0, body=b''):
-        '''self._lock must be held.'''
-        assert status == 0 or not body
-        hdr = request.make_reply_header(status, body).encode()
+                return _RPCRequest(hdr, body)
+            body.skip()
+
+    def _reply(self, request, status=0, body=()):
+        '''self._lock must be held.  body is a list of buffers.'''
+        bufs = [memoryview(buf).cast('B') for buf in body]
+        length = sum(len(buf) for buf in bufs)
+        assert status == 0 or not length
+        hdr = request.make_reply_header(status, length).encode()
+        bufs.insert(0, memoryview(hdr))
         try:
-            self._sock.sendall(hdr + body)
+            # Like sendall(), but without joining the buffers
+            while bufs:
+                sent = self._sock.sendmsg(bufs[:_IOV_MAX])
+                while bufs and sent >= len(bufs[0]):
+                    sent -= len(bufs.pop(0))
+                if sent:
+                    bufs[0] = bufs[0][sent:]
         except socket.error as e:
             self._sock.close()
             raise ConnectionFailure(str(e))
@@ -141,15 +197,19 @@ class RPCConnection(object):
                     handler = handlers.get_handler(req.hdr.cmd)
                     handler_name = (handler.__self__.__class__.__name__ + '.' +
                                     handler.__name__)
-                    if handler.rpc_request_class is not None:
-                        req_obj = handler.rpc_request_class.decode(req.data)
                 except KeyError:
                     raise RPCProcedureUnavailable()
-                except (EOFError, XDREncodingError):
-                    raise RPCEncodingError()
 
                 # Call handler
-                if handler.rpc_request_class is not None:
+                if handler.rpc_streaming:
+                    # The handler reads the body itself
+                    ret_obj = handler(req.body)
+                elif handler.rpc_request_class is not None:
+                    try:
+                        req_obj = handler.rpc_request_class.decode(
+                            req.body.read(req.body.remaining))
+                    except (EOFError, XDREncodingError):
+                        raise RPCEncodingError()
                     ret_obj = handler(req_obj)
                 else:
                     ret_obj = handler()
@@ -157,16 +217,19 @@ class RPCConnection(object):
                 # Encode reply
                 if ret_obj is None:
                     assert handler.rpc_reply_class is None
-                    ret = b''
+                    ret = []
                 else:
                     assert isinstance(ret_obj, handler.rpc_reply_class)
-                    ret = ret_obj.encode()
+                    ret = ret_obj.encode_segments()
 
-                # Send reply
+                # Send reply, discarding any part of the request the
+                # handler did not read
+                req.body.skip()
                 self._reply(req, body=ret)
                 if handlers.log_rpcs:
                     _log.debug('%s => success', handler_name)
             except RPCError as e:
+                req.body.skip()
                 self._reply(req, status=e.code)
                 if handlers.log_rpcs:
                     _log.debug('%s => %s', handler_name, e.__class__.__name__)
@@ -195,13 +258,15 @@ class RPCHandlers(with_metaclass(_RPCMeta, object)):
     log_rpcs = False
 
     @staticmethod
-    def handler(cmd, request_class=None, reply_class=None):
+    def handler(cmd, request_class=None, reply_class=None, streaming=False):
         '''Decorator declaring the function to be an RPC handler with the
-        given command number and request class.'''
+        given command number and request class.  A streaming handler is
+        passed an RPCRequestBody from which to read the encoded request.'''
         def decorator(func):
             func.rpc_procedure = cmd
             func.rpc_request_class = request_class
             func.rpc_reply_class = reply_class
+            func.rpc_streaming = streaming
             return func
         return decorator
 
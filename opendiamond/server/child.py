@@ -10,19 +10,29 @@
 #  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
 #
 
-'''Forking and monitoring of search processes by supervisor.'''
+'''Forking and monitoring of search processes by supervisor.
+
+To take process setup off the connection path, the supervisor can keep
+spare search processes which are forked, placed in their cgroups and
+initialized ahead of time.  Each waits on a Unix socket for the supervisor
+to pass it an accepted connection pair.'''
 
 from builtins import range
 from builtins import object
+from collections import OrderedDict
 import logging
 import os
 import shutil
 import signal
+import socket
 import sys
 from tempfile import mkdtemp
 import time
 
-from opendiamond.helpers import signalname
+from opendiamond.helpers import recv_fds, send_fds, signalname
+
+# Environment variable giving a search process its cgroup directory
+SEARCH_CGROUP_ENV = 'DIAMOND_SEARCH_CGROUP'
 
 _log = logging.getLogger(__name__)
 
@@ -41,10 +51,30 @@ class _SearchChild(object):
         if fork and cgroupdir is not None:
             self._cgroupdir = mkdtemp(dir=cgroupdir, prefix='diamond-')
             self._taskfile = os.path.join(self._cgroupdir, 'tasks')
+            self._init_cpuset(cgroupdir)
         else:
             self._cgroupdir = None
             self._taskfile = None
 
+    def _init_cpuset(self, parent):
+        '''If the cgroup hierarchy includes the cpuset controller, give the
+        new cgroup its parent's CPUs and memory nodes, since tasks can't
+        join a cpuset cgroup without them.  Search workers are then
+        placed within those CPUs.'''
+        for name in 'cpuset.cpus', 'cpuset.mems':
+            path = os.path.join(self._cgroupdir, name)
+            try:
+                with open(path) as fh:
+                    if fh.read().strip():
+                        continue
+                with open(os.path.join(parent, name)) as fh:
+                    value = fh.read()
+                with open(path, 'w') as fh:
+                    fh.write(value)
+            except IOError:
+                # No cpuset controller
+                pass
+
     def start(self):
         '''Fork off the child and return pid in the parent, 0 in the child.'''
         assert not self._started
@@ -63,6 +93,8 @@ class _SearchChild(object):
             # Move ourselves into a dedicated cgroup if available
             if self._taskfile is not None:
                 open(self._taskfile, 'w').write('%d\n' % os.getpid())
+                # So that leased pooled filters can join it
+                os.environ[SEARCH_CGROUP_ENV] = self._cgroupdir
         else:
             _log.info('Launching PID %d', self.pid)
 
@@ -120,10 +152,15 @@ class _SearchChild(object):
 class ChildManager(object):
     '''The set of forked search processes.'''
 
-    def __init__(self, cgroupdir=None, fork=True):
+    def __init__(self, cgroupdir=None, fork=True, spares=0):
         self._children = dict()
         self._cgroupdir = cgroupdir
         self._fork = fork
+        # Spare processes can't be used without forking
+        self._spares = spares if fork else 0
+        # pid -> supervisor end of the socket to an idle spare process,
+        # oldest first
+        self._idle = OrderedDict()
         signal.signal(signal.SIGCHLD, self._child_exited)
 
     def start(self, child_function, *args, **kwargs):
@@ -138,14 +175,76 @@ class ChildManager(object):
             try:
                 # Reset SIGCHLD handler
                 signal.signal(signal.SIGCHLD, signal.SIG_DFL)
+                self._close_idle()
                 # Run the child function
                 child_function(*args, **kwargs)
             finally:
                 # The child must never return
                 sys.exit(0)
 
+    def prefork(self, init_function, child_function):
+        '''Fork spare search processes until the configured number are
+        idle.  Each calls init_function() and then waits for a connection
+        pair from handoff(), which it passes to child_function(control,
+        data).  A spare exits without calling child_function if the
+        supervisor does.'''
+        while len(self._idle) < self._spares:
+            sock, child_sock = socket.socketpair(socket.AF_UNIX,
+                                                 socket.SOCK_SEQPACKET)
+            child = _SearchChild(self._cgroupdir, self._fork)
+            pid = child.start()
+            if pid != 0:
+                # Parent
+                child_sock.close()
+                self._children[pid] = child
+                self._idle[pid] = sock
+            else:
+                # Child
+                try:
+                    signal.signal(signal.SIGCHLD, signal.SIG_DFL)
+                    sock.close()
+                    self._close_idle()
+                    init_function()
+                    _msg, fds = recv_fds(child_sock, 1, 2)
+                    child_sock.close()
+                    if len(fds) == 2:
+                        child_function(socket.socket(fileno=fds[0]),
+                                       socket.socket(fileno=fds[1]))
+                    else:
+                        for fd in fds:
+                            os.close(fd)
+                finally:
+                    # The child must never return
+                    sys.exit(0)
+
+    def handoff(self, control, data):
+        '''Pass a connection pair to an idle spare process.  Return False
+        if there is none.'''
+        while self._idle:
+            pid, sock = self._idle.popitem(last=False)
+            try:
+                send_fds(sock, b'\0', [control.fileno(), data.fileno()])
+            except (OSError, IOError):
+                # Exited since we last checked
+                continue
+            finally:
+                sock.close()
+            _log.info('Handing connection to PID %d', pid)
+            return True
+        return False
+
+    def _close_idle(self):
+        '''In a forked process, close the sockets to idle spares, so that
+        they can detect exit of the supervisor.'''
+        for sock in self._idle.values():
+            sock.close()
+        self._idle.clear()
+
     def _cleanup_child(self, pid):
         '''Clean up the specified search process.'''
+        sock = self._idle.pop(pid, None)
+        if sock is not None:
+            sock.close()
         try:
             child = self._children.pop(pid)
             child.cleanup()
@@ -37,6 +37,8 @@ Result cache:
 
 Attribute cache:
     'attribute:' + murmur(attribute value) => attribute value
+    'attribute:' + murmur(attribute value) + ':' + method =>
+        compressed attribute value       # if CACHECOMPRESS is set
 
 murmur() is the output of MurmurHash3_x64_128 with a seed of 0xbb40e64d.
 murmur() and SHA256() both produce a lowercase hex string.
@@ -62,7 +64,13 @@ attribute cache.  If they are present, we store those values in the object
 and skip execution of the filter.  Otherwise, we execute the filter.  To
 avoid storing cheaply recomputable values in the attribute cache, we only
 cache values resulting from filter executions that produce attribute data at
-less than 2 MB/s.
+less than 2 MB/s, measured after compression.  This admits values which save
+the most recomputation time per byte of Redis memory.
+
+Each worker keeps recently used result and attribute cache entries in an
+in-process LRU in front of Redis.  Result cache entries for a window of
+upcoming objects are fetched from Redis in a single request, and new cache
+entries are written back to Redis in batches by a background thread.
 '''
 from __future__ import print_function
 from __future__ import division
@@ -73,8 +81,11 @@ from builtins import str
 from builtins import range
 from past.utils import old_div
 from builtins import object
+from collections import OrderedDict, deque
+from concurrent import futures
 import docker
 import fcntl
+import io
 import logging
 import os
 import psutil
@@ -86,22 +97,41 @@ import socket
 import subprocess
 import threading
 import multiprocessing as mp
+from queue import Queue, Empty
 import time
 import uuid
 import yaml
+import zlib
 
 from opendiamond.helpers import murmur, signalname, split_scheme
 from opendiamond.rpc import ConnectionFailure
-from opendiamond.server.object_ import ATTR_DATA, ATTR_OBJ_ID, ObjectLoader, ObjectLoadError
+from opendiamond.server import filterpool
+from opendiamond.server.placement import CPUPlacement, current_cpus, \
+    format_cpulist
+from opendiamond.server.object_ import ATTR_DATA, ATTR_OBJ_ID, ObjectLoader, ObjectLoadError, \
+    ObjectPrefetcher, SharedObjectQueue
 from opendiamond.server.statistics import FilterStatistics, Timer, \
     FilterRunnerLogger, FilterStackRunnerLogger, NoLogger
 
 ATTR_FILTER_SCORE = '_filter.%s_score'  # arg: filter name
 ATTR_GT_LABEL = '_gt_label'  # attr of ground truth label
 # If a filter produces attribute values at less than this rate
-# (total attribute value size / execution time), we will cache the attribute
-# values as well as the filter results.
+# (total stored attribute value size / execution time), we will cache the
+# attribute values as well as the filter results.
 ATTRIBUTE_CACHE_THRESHOLD = 2 << 20  # bytes/sec
+# If FILTERREORDER is set, each worker reorders independent filters by
+# their observed cost and selectivity after processing this many objects.
+FILTER_REORDER_INTERVAL = 100  # objects
+# Filters which have processed fewer objects than this are not ranked yet
+# and keep running as early as their dependencies allow.
+FILTER_REORDER_MIN_SAMPLES = 20  # objects
+# Interval between worker scaling decisions
+WORKER_SCALE_INTERVAL = 2  # seconds
+# Interval between checks for filters exceeding FILTERTIMEOUT
+WATCHDOG_INTERVAL = 1  # seconds
+# Time an exiting worker allows for queued result cache updates to reach
+# Redis
+CACHE_FLUSH_TIMEOUT = 5  # seconds
 DEBUG = False
 
 # Used for pipe buffer size control via fcntl
@@ -138,6 +168,10 @@ class _DropObject(Exception):
     without caching the drop result.'''
 
 
+class _QueueClosed(Exception):
+    '''A reexecution queue handed us its end marker.'''
+
+
 class _FilterConnection(object):
     """A connection to a filter specified by fin and fout.
 
@@ -145,6 +179,9 @@ class _FilterConnection(object):
     fout -- A file-like that WE can write to.
     """
 
+    # Whether the filter has already reported init-success
+    initialized = False
+
     def __init__(self, fin, fout, name, args, blob):
         try:
             self._name = name
@@ -194,7 +231,7 @@ class _FilterConnection(object):
             arr.append(str)
 
     def _send_value(self, value):
-        if not isinstance(value, bytes):
+        if not isinstance(value, (bytes, memoryview)):
             value = str(value).encode()
         self._fout.write(b'%d\n' % len(value))
         self._fout.write(value)
@@ -230,6 +267,11 @@ class _FilterConnection(object):
         self.send(keys)
         self.send(values)
 
+    def kill(self):
+        """Kill the filter from another thread, so that a pending read sees
+        end of file.  Return False if that is not possible."""
+        return False
+
     def hint_large_attribute(self, size):
         try:
             size = min(size, 1024 * 1024)
@@ -259,6 +301,13 @@ class _FilterProcess(_FilterConnection):
             fin=self._proc.stdout, fout=self._proc.stdin,
             name=name, args=args, blob=blob)
 
+    def kill(self):
+        try:
+            os.kill(self._proc.pid, signal.SIGKILL)
+            return True
+        except OSError:
+            return False
+
     def __del__(self):
         # try a 'gentle' shutdown first
         try:
@@ -278,6 +327,80 @@ class _FilterProcess(_FilterConnection):
             _log.info('Filter %s exited with status %d', self, ret)
 
 
+class _PrefixedPipe(io.RawIOBase):
+    """A pipe from which some data has already been read elsewhere."""
+
+    def __init__(self, fd, prefix):
+        io.RawIOBase.__init__(self)
+        self._fd = fd
+        self.prefix = prefix
+
+    def fileno(self):
+        return self._fd
+
+    def readable(self):
+        return True
+
+    def readinto(self, b):
+        if self.prefix:
+            count = min(len(b), len(self.prefix))
+            b[:count] = self.prefix[:count]
+            self.prefix = self.prefix[count:]
+            return count
+        try:
+            return os.readv(self._fd, [b])
+        except BlockingIOError:
+            return None
+
+    def close(self):
+        if not self.closed:
+            os.close(self._fd)
+        io.RawIOBase.close(self)
+
+
+class _PooledFilter(_FilterConnection):
+    """Connection to a filter process leased from the filter pool."""
+
+    def __init__(self, name, lease):
+        # The pool has already sent the filter its arguments
+        # pylint: disable=super-init-not-called
+        self._name = name
+        self._sock, (fd_out, fd_in), self.initialized, pending = lease
+        self._pipe = _PrefixedPipe(fd_in, pending)
+        self._fin = io.BufferedReader(self._pipe)
+        self._fout = os.fdopen(fd_out, 'wb')
+
+    def release(self, initialized):
+        """Return the process to the pool.  Must only be called between
+        objects."""
+        # Collect filter output we have read but not consumed, which the
+        # next lessee must see first
+        os.set_blocking(self._pipe.fileno(), False)
+        pending = (self._fin.peek() or b'') + self._pipe.prefix
+        if len(pending) <= filterpool.MAX_MESSAGE:
+            self._sock.send(json.dumps({'initialized': initialized})
+                            .encode() + b'\n' + pending)
+        self.close()
+
+    def kill(self):
+        # The pool kills processes whose lease ends without a release
+        try:
+            self._sock.shutdown(socket.SHUT_RDWR)
+            return True
+        except (OSError, IOError):
+            return False
+
+    def close(self):
+        for f in (self._fin, self._fout, self._sock):
+            try:
+                f.close()
+            except (OSError, IOError):
+                pass
+
+    def __del__(self):
+        self.close()
+
+
 class _FilterTCP(_FilterConnection):
     """Connection to a filter which is listening on a TCP port"""
 
@@ -305,6 +428,13 @@ class _FilterTCP(_FilterConnection):
                 # _log.info('Filter %s did not close connection properly' % self)
                 pass
 
+    def kill(self):
+        try:
+            self._sock.shutdown(socket.SHUT_RDWR)
+            return True
+        except (OSError, IOError):
+            return False
+
     def hint_large_attribute(self, size):
         pass
 
@@ -321,8 +451,8 @@ class _FilterResult(object):
         self.output_attrs = output_attrs or {}  # name -> murmur(value)
         self.omit_attrs = set(omit_attrs) if omit_attrs else set()  # names
         self.score = score
-        # Whether to cache output attributes in the attribute cache
-        self.cache_output = False
+        # Filter execution time, or None if the result came from the cache
+        self.compute_seconds = None
 
     def encode(self):
         props = {
@@ -387,6 +517,20 @@ class _ObjectProcessor(object):
         to accept the object or False to drop it.'''
         raise NotImplementedError()
 
+    def release(self):
+        '''Return any pooled filter process for use by later searches.'''
+        pass
+
+    def check_timeout(self, timeout):
+        '''Called from the watchdog thread.  Kill the evaluator if it has
+        spent more than timeout seconds on the current object.'''
+        pass
+
+    def abort(self):
+        '''Called from another thread.  Kill the evaluator if it is in the
+        middle of an object, which is then dropped.'''
+        pass
+
 
 class _ObjectFetcher(_ObjectProcessor):
     '''A context for loading object data from the dataretriever.'''
@@ -399,6 +543,10 @@ class _ObjectFetcher(_ObjectProcessor):
     def __str__(self):
         return 'fetcher'
 
+    def preload(self, responses):
+        '''Supply prefetched dataretriever responses for the next object.'''
+        self._loader.preload(responses)
+
     def _get_cache_digest(self):
         return 'dataretriever'
 
@@ -429,6 +577,16 @@ class _FilterRunner(_ObjectProcessor):
         self._state = state
         self._proc = None
         self._proc_initialized = False
+        # Whether the filter may be in the middle of an object
+        self._proc_busy = False
+        # Guards _started, _timed_out and _proc against the watchdog
+        self._lock = threading.Lock()
+        # Start time of the current object, once the filter has initialized
+        self._started = None
+        # Whether the watchdog killed the filter during the current object
+        self._timed_out = False
+        # Whether abort() killed the filter during the current object
+        self._aborted = False
         self._logger = FilterRunnerLogger(filter.stats)
         # self._logger = NoLogger(filter.stats)
 
@@ -444,15 +602,26 @@ class _FilterRunner(_ObjectProcessor):
         self._logger.on_cache_hit(accept, gt_present)
 
     def evaluate(self, obj):
+        if (self._timed_out or self._aborted) and self._proc is not None:
+            # The watchdog killed the filter after it returned its last
+            # result.  Start a new one.
+            self._proc = None
         if self._proc is None:
             self._proc = self._filter.connect()
-            self._proc_initialized = False
+            self._proc_initialized = self._proc.initialized
             self._logger.on_connected()
 
         self._logger.on_start_evaluate()
         timer = Timer()
         result = _FilterResult()
         proc = self._proc
+        self._proc_busy = True
+        with self._lock:
+            self._timed_out = False
+            self._aborted = False
+            # Filter initialization is not subject to the time budget
+            self._started = time.time() if self._proc_initialized else None
+        budget = self._state.config.filter_time_budget
         try:
             while True:
                 # XXX Work here to change the filter protocol (server side):
@@ -465,6 +634,8 @@ class _FilterRunner(_ObjectProcessor):
                     # its init function may e.g. produce log messages.
                     self._proc_initialized = True
                     self._logger.on_initialized()
+                    with self._lock:
+                        self._started = time.time()
                 elif cmd == 'get-attribute':
                     key = proc.get_item().decode()
                     _log.debug('{}: {} {}'.format(obj, cmd, key))
@@ -541,6 +712,10 @@ class _FilterRunner(_ObjectProcessor):
                     print(proc.get_item().decode(), end=' ')
                 elif cmd == 'result':
                     result.score = float(proc.get_item())
+                    # The object is finished; don't let the watchdog kill
+                    # the filter
+                    with self._lock:
+                        self._started = None
                     break
                 elif cmd == 'ensure-resource':
                     # Create scoped resource here
@@ -556,18 +731,38 @@ class _FilterRunner(_ObjectProcessor):
                             "Unrecognized resource scope" % scope
                         )
                     proc.send_dict(uri)
+                elif cmd == 'get-deadline':
+                    # Seconds left in the budget for this object
+                    if budget and self._started is not None:
+                        proc.send(budget - (time.time() - self._started))
+                    else:
+                        proc.send(None)
                 elif cmd == 'hint-large-attribute':
                     size = int(proc.get_item())
                     _log.info("Hint: attribute size %d", size)
                     proc.hint_large_attribute(size)
+                    with self._lock:
+                        self._started = None
                     break
                 elif cmd == '':
                     # Encountered EOF on pipe
                     raise IOError()
                 else:
                     raise FilterExecutionError('%s: unknown command: %s' % (self, cmd))
+            self._proc_busy = False
         except IOError:
-            if self._proc_initialized:
+            if self._aborted:
+                _log.debug('Filter %s aborted on object %s', self, obj)
+                self._proc = None
+                raise _DropObject()
+            elif self._timed_out:
+                # The watchdog killed the filter.  Drop the object without
+                # caching the result; the next object starts a new filter.
+                _log.warning('Filter %s timed out on object %s', self, obj)
+                self._logger.on_timeout()
+                self._proc = None
+                raise _DropObject()
+            elif self._proc_initialized:
                 # Filter died on an object.  Drop the object without caching
                 # the result.
                 _log.error('Filter %s (signature %s) died on object %s',
@@ -580,18 +775,62 @@ class _FilterRunner(_ObjectProcessor):
                 raise FilterExecutionError("Filter %s failed to initialize"
                                            % self)
         finally:
+            with self._lock:
+                self._started = None
             accept = self.threshold(result)
             gt_present = ATTR_GT_LABEL in list(result.input_attrs.keys())
             self._logger.on_done_evaluate(accept, gt_present)
-            lengths = [len(obj[k]) for k in result.output_attrs]
-            throughput = int(old_div(sum(lengths), timer.elapsed_seconds))
-            if throughput < ATTRIBUTE_CACHE_THRESHOLD:
-                result.cache_output = True
+            result.compute_seconds = timer.elapsed_seconds
+            if budget and result.compute_seconds > budget:
+                self._logger.on_deadline_exceeded()
         return result
 
     def threshold(self, result):
         return self._filter.min_score <= result.score <= self._filter.max_score
 
+    def release(self):
+        if (self._proc is not None and not self._proc_busy and
+                isinstance(self._proc, _PooledFilter)):
+            try:
+                self._proc.release(self._proc_initialized)
+            except (OSError, IOError) as e:
+                _log.warning('Failed to release filter %s: %s', self, e)
+            self._proc = None
+
+    def abort(self):
+        with self._lock:
+            if not self._proc_busy or self._proc is None or self._aborted:
+                return
+            self._aborted = True
+            if not self._proc.kill():
+                _log.warning('Cannot interrupt filter %s', self)
+
+    def check_timeout(self, timeout):
+        with self._lock:
+            if (self._started is None or self._timed_out or
+                    time.time() - self._started < timeout):
+                return
+            _log.warning('Killing filter %s after %d seconds on an object',
+                         self, timeout)
+            self._timed_out = True
+            # Under the lock, so that we can't kill the next object
+            if not self._proc.kill():
+                _log.warning('Cannot interrupt filter %s', self)
+
+    def estimate(self):
+        '''Return (average execution time in us, fraction of objects
+        passed) for this filter, or None if the filter hasn't seen enough
+        objects yet.'''
+        stats = self._filter.stats
+        with stats.lock:
+            processed = stats.objs_processed
+            dropped = stats.objs_dropped
+            execution_us = stats.execution_us
+        if processed < FILTER_REORDER_MIN_SAMPLES:
+            return None
+        return (old_div(float(execution_us), processed),
+                1 - old_div(float(dropped), processed))
+
 
 class Filter(object):
     '''A filter with arguments.'''
@@ -611,6 +850,7 @@ class Filter(object):
         self.code_path = None
         self.signature = None
         self.blob = None
+        self.blob_signature = None
         self.cache_digest = None
         self.mode = None
 
@@ -636,6 +876,7 @@ class Filter(object):
         self.code_path = code_path
         self.signature = code_signature
         self.blob = blob
+        self.blob_signature = blob_signature
         self.cache_digest = cache_digest
 
         # Resolve mode and reload connect()
@@ -663,7 +904,7 @@ class Filter(object):
         if scheme == 'sha256':
             sig = path.lower()
             try:
-                return (state.blob_cache[sig], sig)
+                return (state.blob_cache.view(sig), sig)
             except KeyError:
                 raise FilterDependencyError('Missing blob for filter ' +
                                             self.name)
@@ -690,6 +931,9 @@ class Filter(object):
             # default executable mode
             # TODO handle debug command
             def wrapper(_):
+                lease = filterpool.lease_filter(self)
+                if lease is not None:
+                    return _PooledFilter(self.name, lease)
                 return _FilterProcess(
                     code_argv=[self.code_path],
                     name=self.name,
@@ -717,7 +961,8 @@ class Filter(object):
                                     'EXEC:\"%s --filter\"' % (docker_port, filter_command)
 
                 def wrapper(_):
-                    uri = state.context.ensure_resource('docker',docker_image, docker_command)
+                    uri = state.context.ensure_resource('docker',docker_image, docker_command,
+                                                        **_docker_placement(state.config))
 
                     sock = None
                     host, port = uri['IPAddress'], docker_port
@@ -758,7 +1003,8 @@ class Filter(object):
                     # keep the container running alive, detached
                     docker_command = '/bin/bash'
                     handle = state.context.ensure_resource('docker', docker_image, docker_command,
-                                                           volumes = {TMPDIR: {'bind': map_vol, 'mode': 'rw'}}, tty=True)
+                                                           volumes = {TMPDIR: {'bind': map_vol, 'mode': 'rw'}}, tty=True,
+                                                           **_docker_placement(state.config))
 
                     # launch a new filter process inside the containers
                     client = docker.from_env()
@@ -799,22 +1045,109 @@ class Filter(object):
         return _FilterRunner(state, self)
 
 
+def _docker_placement(config):
+    '''Return keyword arguments starting a Docker filter container on the
+    calling worker's CPUs.  Workers sharing CPUs share containers.'''
+    if config.cpu_placement == 'none':
+        return {}
+    return {'cpuset_cpus': format_cpulist(current_cpus())}
+
+
+def _cache_codec(method):
+    '''Return (compress, decompress) functions for the specified attribute
+    cache compression method.'''
+    if method == 'lz4':
+        import lz4.frame
+        return lz4.frame.compress, lz4.frame.decompress
+    elif method == 'zstd':
+        import zstandard
+        return (zstandard.ZstdCompressor().compress,
+                zstandard.ZstdDecompressor().decompress)
+    elif method == 'zlib':
+        return (lambda data: zlib.compress(data, 1)), zlib.decompress
+    raise ValueError('Unknown cache compression method: %s' % method)
+
+
+class _LRUCache(object):
+    '''An in-process cache of Redis values, bounded by the total size of
+    the values and evicting the least recently used entries first.'''
+
+    def __init__(self, max_bytes):
+        self._max_bytes = max_bytes
+        self._bytes = 0
+        self._entries = OrderedDict()
+
+    def get(self, key):
+        '''Return the cached value or None.'''
+        try:
+            value = self._entries.pop(key)
+        except KeyError:
+            return None
+        self._entries[key] = value
+        return value
+
+    def put(self, key, value):
+        old = self._entries.pop(key, None)
+        if old is not None:
+            self._bytes -= len(old)
+        if len(value) > self._max_bytes:
+            return
+        self._entries[key] = value
+        self._bytes += len(value)
+        while self._bytes > self._max_bytes:
+            _key, evicted = self._entries.popitem(last=False)
+            self._bytes -= len(evicted)
+
+
 class FilterStackRunner(mp.Process):
     '''A context for processing objects with a FilterStack.  Handles querying
     and updating the result and attribute caches.'''
 
-    def __init__(self, state, filters, obj_queue, name):
+    def __init__(self, state, filters, obj_queue, name, dependencies=None,
+                 cpus=None):
         mp.Process.__init__(self, name=name)
 
         # self.setDaemon(True) # a daemonic process can't create child processes which we need to launch filters
         self._state = state
         fetcher = _ObjectFetcher(state)
-        runners = [fetcher] + [f.bind(state) for f in filters]
+        bound = dict([(f, f.bind(state)) for f in filters])
+        runners = [fetcher] + [bound[f] for f in filters]
+        self._fetcher = fetcher
         self._runners = runners
         self._obj_queue = obj_queue
+        # runner -> set(runners it depends on)
+        if dependencies is None:
+            dependencies = dict()
+        self._dependencies = dict(
+            [(bound[f], set([bound[d] for d in dependencies.get(f, ())
+                             if d in bound]))
+             for f in filters])
+        self._reorder_countdown = FILTER_REORDER_INTERVAL
+        # CPUs for this worker and its filter processes, or None
+        self._cpus = cpus
 
         self._redis = None  # May be None if caching is not enabled
         self._warned_cache_update = False
+        config = state.config
+        self._lru = _LRUCache(config.cache_lru_memory << 20)
+        # result cache key -> value (or None) for objects in self._window
+        self._lookahead = dict()
+        # Objects taken from the queue but not yet evaluated
+        self._window = deque()
+        # Cache updates for the background writer; None if writing
+        # synchronously
+        self._cache_writes = None
+        # runner -> single-thread executor, if evaluating filters in
+        # parallel
+        self._executors = dict()
+        # future -> runner, for filters still running on dropped objects
+        self._abandoned = dict()
+        # FilterExecutionError from an abandoned filter, raised by the
+        # next evaluation
+        self._abandoned_error = None
+        if config.cache_compression is not None:
+            self._compress, self._decompress = \
+                _cache_codec(config.cache_compression)
         self._logger = FilterStackRunnerLogger(state.stats)
         # self._logger = NoLogger(state.stats)
 
@@ -824,17 +1157,136 @@ class FilterStackRunner(mp.Process):
         redis-py thread-safety issues.'''
         config = self._state.config
         if self._redis is None and config.cache_server is not None:
-            host, port = config.cache_server
-            self._redis = Redis(host=host, port=port,
-                                db=config.cache_database,
-                                password=config.cache_password)
-            # Ensure the Redis server is available
-            self._redis.ping()
+            self._redis = self._connect_cache()
+
+    def _connect_cache(self):
+        config = self._state.config
+        host, port = config.cache_server
+        redis = Redis(host=host, port=port,
+                      db=config.cache_database,
+                      password=config.cache_password)
+        # Ensure the Redis server is available
+        redis.ping()
+        return redis
+
+    def _cache_get_many(self, keys):
+        '''Return the cached values (or None) for the specified keys,
+        trying the LRU and the lookahead window before Redis.'''
+        values = dict()
+        missing = []
+        for key in keys:
+            value = self._lru.get(key)
+            if value is None:
+                value = self._lookahead.get(key)
+            if value is not None or key in self._lookahead:
+                values[key] = value
+            else:
+                missing.append(key)
+        if missing:
+            for key, value in zip(missing, self._redis.mget(missing)):
+                values[key] = value
+                if value is not None:
+                    self._lru.put(key, value)
+        return [values[key] for key in keys]
+
+    def _cache_set_many(self, mapping):
+        '''Store the key -> value mapping in the LRU and in Redis.'''
+        for key, value in mapping.items():
+            self._lru.put(key, value)
+            if key in self._lookahead:
+                self._lookahead[key] = value
+        if self._cache_writes is not None:
+            self._cache_writes.put(mapping)
+        else:
+            self._cache_write(self._redis, mapping)
+
+    def _cache_write(self, redis, mapping):
+        try:
+            redis.mset(mapping)
+        except ResponseError as e:
+            # mset failed, possibly due to maxmemory quota
+            self._logger.on_cache_write_failed()
+            if not self._warned_cache_update:
+                self._warned_cache_update = True
+                _log.warning('Failed to update cache: %s', e)
+
+    def _cache_writer(self, redis):
+        '''Thread function writing batches of cache updates to Redis until
+        receiving None.'''
+        while True:
+            mapping = self._cache_writes.get()
+            done = mapping is None
+            batch = dict(mapping or ())
+            # Coalesce whatever else has been queued meanwhile
+            while not done:
+                try:
+                    mapping = self._cache_writes.get_nowait()
+                except Empty:
+                    break
+                if mapping is None:
+                    done = True
+                else:
+                    batch.update(mapping)
+            if batch:
+                self._cache_write(redis, batch)
+            if done:
+                return
+
+    def _next_object(self, get, block=True, lookahead=None):
+        '''Return the next (Object, prefetched responses) pair, refilling
+        the lookahead window with get(block) if it is empty.'''
+        if lookahead is None:
+            lookahead = self._state.config.cache_lookahead
+        if not self._window:
+            self._window.append(get(block))
+            while len(self._window) < lookahead:
+                try:
+                    self._window.append(get(False))
+                except Empty:
+                    break
+            if self._redis is not None:
+                # Look up result cache entries for the whole window at once
+                keys = [r.get_cache_key(obj) for obj, _ in self._window
+                        for r in self._runners]
+                self._lookahead = dict()  # Discard the previous window
+                self._lookahead = dict(zip(keys, self._cache_get_many(keys)))
+        return self._window.popleft()
 
     def _get_attribute_key(self, value_sig):
         '''Return an attribute cache lookup key for the specified signature.'''
+        method = self._state.config.cache_compression
+        if method is not None:
+            return 'attribute:%s:%s' % (value_sig, method)
         return 'attribute:' + value_sig
 
+    def _attribute_cache_entries(self, obj, result):
+        '''Return a mapping of attribute cache entries for the output
+        values of the executed filter, or an empty mapping if storing them
+        would not save enough execution time per byte.'''
+        entries = dict()
+        raw_bytes = stored_bytes = 0
+        for key, valsig in result.output_attrs.items():
+            # If this attribute was subsequently overwritten by a
+            # different filter, make sure we're not caching the
+            # newer value against this key.
+            if valsig == obj.get_signature(key):
+                value = obj[key]
+                if not isinstance(value, bytes):
+                    value = str(value).encode()
+                raw_bytes += len(value)
+                if self._state.config.cache_compression is not None:
+                    value = self._compress(value)
+                stored_bytes += len(value)
+                entries[self._get_attribute_key(valsig)] = value
+        if stored_bytes >= ATTRIBUTE_CACHE_THRESHOLD * result.compute_seconds:
+            self._logger.on_attribute_cache_reject()
+            return dict()
+        if entries:
+            _log.debug('Caching attributes: %d bytes, %d stored',
+                       raw_bytes, stored_bytes)
+            self._logger.on_attribute_cache_store(raw_bytes, stored_bytes)
+        return entries
+
     def _result_cache_can_drop(self, obj, cache_results):
         '''Return True if the object can be dropped.  cache_results is a
         runner -> _FilterResult map retrieved from the result cache.'''
@@ -964,19 +1416,23 @@ class FilterStackRunner(mp.Process):
         cache_keys = [self._get_attribute_key(result.output_attrs[k])
                       for k in keys]
         if self._redis is not None and cache_keys:
-            values = self._redis.mget(cache_keys)
+            values = self._cache_get_many(cache_keys)
         else:
             values = [None for k in cache_keys]
         if None in values:
             # One or more attribute values was not cached.  We need
             # to rerun the filter.
             _debug('Uncached output value for %s', runner)
+            self._logger.on_attribute_cache_lookup(False)
             return False
+        self._logger.on_attribute_cache_lookup(True)
+        if self._state.config.cache_compression is not None:
+            values = [self._decompress(v) for v in values]
 
         _debug('Cached output values for %s', runner)
         # Load the attribute values and omit set into the object.
         for key, value in zip(keys, values):
-            obj[key] = value
+            obj.set_with_signature(key, value, result.output_attrs[key])
         for key in result.omit_attrs:
             try:
                 obj.omit(key)
@@ -998,9 +1454,11 @@ class FilterStackRunner(mp.Process):
             keys = [cache_keys[r] for r in self._runners]
             results = [(runner, _FilterResult.decode(data))
                        for runner, data in
-                       zip(self._runners, self._redis.mget(keys))]
+                       zip(self._runners, self._cache_get_many(keys))]
             # runner -> _FilterResult
             cache_results = dict([(k, v) for k, v in results if v is not None])
+            self._logger.on_result_cache_lookup(
+                len(cache_results), len(results) - len(cache_results))
         else:
             cache_results = dict()
 
@@ -1011,6 +1469,9 @@ class FilterStackRunner(mp.Process):
 
         new_results = dict()  # runner -> result
         try:
+            if self._state.config.parallel_filters:
+                return self._evaluate_parallel(obj, cache_results,
+                                               new_results)
             # Run each filter or load its prior result into the object.
             for runner in self._runners:
                 if (runner in cache_results and
@@ -1020,14 +1481,9 @@ class FilterStackRunner(mp.Process):
                 else:
                     result = runner.evaluate(obj)
                     new_results[runner] = result
-                if not runner.threshold(result):
+                if not self._apply_result(obj, runner, result):
                     # Drop decision.
                     return False
-                elif runner.send_score:
-                    # Store the filter score in the object.  This attribute
-                    # is not cached because that would be redundant.
-                    attrname = ATTR_FILTER_SCORE % runner
-                    obj[attrname] = str(result.score) + '\0'
             # Object passes all filters, accept
             return True
         except ObjectLoadError:
@@ -1044,29 +1500,176 @@ class FilterStackRunner(mp.Process):
                     resultmap[cache_keys[runner]] = result.encode()
                     # Attribute cache entries, if the filter was expensive enough
                     # hash(attr val) -> attr val
-                    if result.cache_output:
-                        _log.debug('Caching attribute: {}'.format(','.join([ '{}[{}]'.format(key, len(obj[key])) for key in result.output_attrs.keys() ])))
-                        for key, valsig in result.output_attrs.items():
-                            # If this attribute was subsequently overwritten by a
-                            # different filter, make sure we're not caching the
-                            # newer value against this key.
-                            if valsig == obj.get_signature(key):
-                                attribute_key = self._get_attribute_key(valsig)
-                                resultmap[attribute_key] = obj[key]
+                    if result.compute_seconds is not None:
+                        resultmap.update(
+                            self._attribute_cache_entries(obj, result))
                 # Do it
                 if resultmap:
-                    try:
-                        self._redis.mset(resultmap)
-                    except ResponseError as e:
-                        # mset failed, possibly due to maxmemory quota
-                        if not self._warned_cache_update:
-                            self._warned_cache_update = True
-                            _log.warning('Failed to update cache: %s', e)
+                    self._cache_set_many(resultmap)
+
+    def _apply_result(self, obj, runner, result):
+        '''Return False if the result drops the object.'''
+        if not runner.threshold(result):
+            return False
+        elif runner.send_score:
+            # Store the filter score in the object.  This attribute
+            # is not cached because that would be redundant.
+            attrname = ATTR_FILTER_SCORE % runner
+            obj[attrname] = str(result.score) + '\0'
+        return True
+
+    def _evaluate_parallel(self, obj, cache_results, new_results):
+        '''Run filters whose dependencies have been satisfied concurrently,
+        each in its own thread talking to its filter process, and return
+        True to accept the object.  Record executed filters in new_results.
+
+        The object is dropped as soon as any filter drops it.  Filters still
+        running on a dropped object are left to finish in the background
+        and their results are discarded; each filter's thread finishes the
+        previous object before starting the next one.  Their errors are
+        logged, and fatal ones are raised by the next evaluation.
+        Independent filters must not write the same attribute.'''
+        error, self._abandoned_error = self._abandoned_error, None
+        if error is not None:
+            raise error
+        running = dict()  # future -> runner
+        try:
+            return self._evaluate_parallel_running(obj, cache_results,
+                                                   new_results, running)
+        finally:
+            for future, runner in running.items():
+                self._abandoned[future] = runner
+                future.add_done_callback(self._abandoned_done)
+
+    def _abandoned_done(self, future):
+        '''Done callback for a filter which was still running when its
+        object was dropped.'''
+        runner = self._abandoned.pop(future, None)
+        if future.cancelled():
+            return
+        error = future.exception()
+        if isinstance(error, FilterExecutionError):
+            _log.error('Filter %s failed on a dropped object: %s',
+                       runner, error)
+            self._abandoned_error = error
+        elif isinstance(error, ObjectLoadError):
+            _log.warning('Filter %s could not load a dropped object: %s',
+                         runner, error)
+        elif error is not None and not isinstance(error, _DropObject):
+            _log.error('Filter %s failed on a dropped object', runner,
+                       exc_info=(type(error), error, error.__traceback__))
+
+    def _evaluate_parallel_running(self, obj, cache_results, new_results,
+                                   running):
+        '''Body of _evaluate_parallel.  running is the future -> runner
+        mapping of filters still running.'''
+        # The fetcher loads the object, so everything depends on it
+        fetcher = self._runners[0]
+        result = fetcher.evaluate(obj)
+        new_results[fetcher] = result
+        if not self._apply_result(obj, fetcher, result):
+            return False
+
+        pending = self._runners[1:]
+        done = set()
+        while pending or running:
+            progress = True
+            while progress:
+                progress = False
+                for runner in list(pending):
+                    if not self._dependencies.get(runner, set()) <= done:
+                        continue
+                    pending.remove(runner)
+                    if (runner in cache_results and
+                            self._attribute_cache_try_load(
+                                runner, obj, cache_results[runner])):
+                        if not self._apply_result(obj, runner,
+                                                  cache_results[runner]):
+                            return False
+                        done.add(runner)
+                        progress = True
+                    else:
+                        executor = self._executors.get(runner)
+                        if executor is None:
+                            executor = futures.ThreadPoolExecutor(1)
+                            self._executors[runner] = executor
+                        running[executor.submit(runner.evaluate, obj)] = \
+                            runner
+            if not running:
+                # Unsatisfiable dependencies; FilterStack prevents this
+                break
+            finished, _ = futures.wait(list(running.keys()),
+                                       return_when=futures.FIRST_COMPLETED)
+            for future in finished:
+                runner = running.pop(future)
+                result = future.result()
+                new_results[runner] = result
+                if not self._apply_result(obj, runner, result):
+                    return False
+                done.add(runner)
+        return True
+
+    def _reorder(self):
+        '''Reorder the filters so that cheap, selective filters run first,
+        subject to the declared dependencies.  Filters without enough
+        statistics keep their current relative order and run before ranked
+        ones so that they can collect some.'''
+        fetcher = self._runners[0]
+        pending = self._runners[1:]
+        estimates = dict([(r, r.estimate()) for r in pending])
+
+        def rank(runners):
+            # Expected execution time spent per object dropped when
+            # running this sequence of runners.  Lower is better.
+            cost = 0.0
+            passed = 1.0
+            for runner in runners:
+                runner_cost, runner_passed = estimates[runner]
+                cost += passed * runner_cost
+                passed *= runner_passed
+            if passed >= 1:
+                return float('inf')
+            return old_div(cost, 1 - passed)
+
+        def effective_rank(runner):
+            if estimates[runner] is None:
+                return (False, 0)
+            # A cheap filter that drops nothing may still be worth running
+            # early to enable a selective filter which depends on it.
+            best = rank([runner])
+            for dependent in pending:
+                deps = self._dependencies[dependent]
+                if (runner in deps and deps <= placed.union([runner]) and
+                        estimates[dependent] is not None):
+                    best = min(best, rank([runner, dependent]))
+            return (True, best)
+
+        placed = set()
+        order = []
+        while pending:
+            # pending is always a valid topological order, so at least one
+            # runner is ready.  min() keeps the current order on ties.
+            ready = [r for r in pending if self._dependencies[r] <= placed]
+            best = min(ready, key=effective_rank)
+            order.append(best)
+            placed.add(best)
+            pending.remove(best)
+        order.insert(0, fetcher)
+        if order != self._runners:
+            _log.debug('Reordered filters: %s',
+                       ', '.join([str(r) for r in order[1:]]))
+            self._runners = order
 
     def evaluate(self, obj):
         '''Evaluate the object and return True to accept or False to drop.'''
         # Connect to Redis cache if not already connected
         self._ensure_cache()
+        # Periodically re-plan the filter order from current statistics
+        if self._state.config.filter_reorder:
+            self._reorder_countdown -= 1
+            if self._reorder_countdown <= 0:
+                self._reorder_countdown = FILTER_REORDER_INTERVAL
+                self._reorder()
         self._logger.on_start_evaluate()
         accept = False
         gt_present = False
@@ -1078,6 +1681,58 @@ class FilterStackRunner(mp.Process):
 
         return accept
 
+    def evaluate_queue(self, queue, report, workers=1):
+        '''Evaluate objects outside a worker process, forever.  queue
+        holds (Object, context) pairs and is shared by workers runners;
+        report(obj, context, accept) is called for each, with accept None
+        if evaluation failed.  As in run(), result cache entries are looked
+        up for several queued objects at once, but only for our share of
+        the queue.  Returns after taking a None entry from the queue.'''
+        def get(block):
+            item = queue.get(block)
+            if item is None:
+                raise _QueueClosed()
+            return item
+
+        self._ensure_cache()
+        while True:
+            lookahead = 1
+            if self._redis is not None:
+                lookahead = max(1, min(self._state.config.cache_lookahead,
+                                       queue.qsize() // workers))
+            try:
+                obj, context = self._next_object(get, lookahead=lookahead)
+            except _QueueClosed:
+                return
+            try:
+                accept = self.evaluate(obj)
+            except Exception:  # pylint: disable=broad-except
+                _log.exception('Evaluating %s failed', obj)
+                accept = None
+            report(obj, context, accept)
+
+    def release(self):
+        '''Return pooled filter processes for use by later searches.'''
+        # Kill filters still busy with a dropped object, so that their
+        # threads don't keep us from exiting.  They are not released.
+        for runner in list(self._abandoned.values()):
+            runner.abort()
+        for executor in self._executors.values():
+            executor.shutdown(wait=False)
+        self._executors = dict()
+        for runner in self._runners:
+            runner.release()
+
+    def _should_retire(self):
+        '''Return True if the worker scaler has asked one worker to exit
+        and we are it.'''
+        retire = self._state.retire_workers
+        with retire.get_lock():
+            if retire.value > 0:
+                retire.value -= 1
+                return True
+        return False
+
     # We want to catch all exceptions
     # pylint: disable=broad-except
     def run(self):
@@ -1085,10 +1740,58 @@ class FilterStackRunner(mp.Process):
         from opendiamond.server.server import _Signalled
         import gc
 
+        # Before starting any threads or filters, which inherit it
+        if self._cpus is not None:
+            try:
+                os.sched_setaffinity(0, self._cpus)
+            except OSError as e:
+                _log.warning('Cannot set CPU affinity of %s: %s', self.name, e)
+
+        config = self._state.config
+        prefetcher = None
+        if config.prefetch_objects > 0:
+            prefetcher = ObjectPrefetcher(config, self._obj_queue,
+                                          config.prefetch_objects,
+                                          config.prefetch_memory << 20)
+            prefetcher.start()
+            get = prefetcher.get
+        else:
+            get = lambda block: (self._obj_queue.get(block), None)
+
+        def no_more_objects(_block):
+            raise Empty()
+
+        writer = None
         try:
+            self._ensure_cache()
+            if self._redis is not None:
+                self._cache_writes = Queue(64)
+                writer = threading.Thread(target=self._cache_writer,
+                                          args=(self._connect_cache(),),
+                                          name='cache-writer-thread')
+                writer.daemon = True
+                writer.start()
+            if config.filter_timeout > 0:
+                _FilterWatchdog(self._runners, config.filter_timeout).start()
+
+            retiring = False
             while True:
                 gc.collect()
-                obj = self._obj_queue.get()
+                if not retiring and self._should_retire():
+                    # Finish the objects we have already taken from the
+                    # queue, then exit
+                    _log.info('Worker %d retiring', os.getpid())
+                    retiring = True
+                    if prefetcher is not None:
+                        prefetcher.stop()
+                    else:
+                        get = no_more_objects
+                try:
+                    obj, responses = self._next_object(get, not retiring)
+                except Empty:
+                    break
+                if responses is not None:
+                    self._fetcher.preload(responses)
                 accept = self.evaluate(obj)
                 if accept:
                     self._state.blast.send(obj)
@@ -1109,10 +1812,101 @@ class FilterStackRunner(mp.Process):
             # (see server/__init__.py)
             _log.debug("Supposed signaled by parent to exit.")
         finally:
+            self.release()
+            if writer is not None:
+                # Flush pending cache updates
+                self._cache_writes.put(None)
+                writer.join(CACHE_FLUSH_TIMEOUT)
             self._logger.on_finish()
             _log.info("Worker %d exiting.", os.getpid())
 
 
+class _FilterWatchdog(threading.Thread):
+    '''Thread killing filters which have spent more than timeout seconds
+    on an object, so that their worker drops the object and continues with
+    a new filter process instead of stalling the search.'''
+
+    def __init__(self, runners, timeout):
+        threading.Thread.__init__(self, name='filter-watchdog-thread')
+        self.daemon = True
+        self._runners = list(runners)
+        self._timeout = timeout
+
+    def run(self):
+        while True:
+            time.sleep(WATCHDOG_INTERVAL)
+            for runner in self._runners:
+                runner.check_timeout(self._timeout)
+
+
+class _WorkerScaler(threading.Thread):
+    '''Thread adding and retiring search workers between minimum and
+    maximum according to the backlog in the object queue, the fraction of
+    time workers spend evaluating objects, and host CPU utilization.
+
+    Workers which are busy while the host has idle CPU are probably
+    waiting on I/O (Docker filters, remote dataretrievers), so another
+    worker can help.  When the host CPU is saturated, additional workers
+    only contend with each other, so one is retired.'''
+
+    # Thresholds for scaling decisions
+    BACKLOG_FILL = 0.25  # fraction of the object queue
+    BUSY_HIGH = 0.8  # fraction of worker time spent evaluating
+    BUSY_LOW = 0.3
+    CPU_HIGH = 95.0  # host CPU percent
+    CPU_LOW = 80.0
+
+    def __init__(self, state, obj_queue, workers, start_worker, minimum,
+                 maximum):
+        threading.Thread.__init__(self, name='worker-scaler-thread')
+        self.daemon = True
+        self._state = state
+        self._obj_queue = obj_queue
+        self._workers = workers
+        self._start_worker = start_worker
+        self._minimum = max(minimum, 1)
+        self._maximum = maximum
+
+    def _active(self):
+        '''Return the number of workers neither exited nor asked to.'''
+        alive = len([w for w in self._workers if w.is_alive()])
+        return alive - self._state.retire_workers.value
+
+    def run(self):
+        stats = self._state.stats
+        psutil.cpu_percent()  # Start measuring
+        with stats.lock:
+            last_us = stats.execution_us
+        last_time = time.time()
+        while True:
+            time.sleep(WORKER_SCALE_INTERVAL)
+            now = time.time()
+            with stats.lock:
+                execution_us = stats.execution_us
+            active = self._active()
+            if active <= 0:
+                # Search finished or shutting down
+                return
+            busy = (old_div(float(execution_us - last_us),
+                            (now - last_time) * 1e6 * active))
+            last_us, last_time = execution_us, now
+            cpu = psutil.cpu_percent()
+            backlog = self._obj_queue.fill() >= self.BACKLOG_FILL
+
+            if (active < self._maximum and backlog and
+                    busy >= self.BUSY_HIGH and cpu < self.CPU_LOW):
+                _log.info('Adding worker: busy %.2f, CPU %.0f%%', busy, cpu)
+                self._start_worker()
+            elif active > self._minimum and (
+                    cpu >= self.CPU_HIGH or
+                    (not backlog and busy < self.BUSY_LOW)):
+                _log.info('Retiring worker: busy %.2f, CPU %.0f%%',
+                          busy, cpu)
+                with self._state.retire_workers.get_lock():
+                    self._state.retire_workers.value += 1
+                stats.update(workers_retired=1)
+
+
 class FilterStack(object):
     '''A set of filters which collectively decide to accept or drop an
     object.'''
@@ -1124,6 +1918,8 @@ class FilterStack(object):
         self._filters = dict([(f.name, f) for f in filters])
         # Ordered list of filters to execute
         self._order = list()
+        # Filter -> set(Filters it directly depends on)
+        self._dependencies = dict()
 
         # Resolve declared dependencies
         # Filters we have already resolved
@@ -1140,11 +1936,14 @@ class FilterStack(object):
                 raise FilterDependencyError('Circular dependency involving '
                                             + filter.name)
             inprocess.add(filter)
+            self._dependencies[filter] = set()
             for depname in filter.dependencies:
                 try:
-                    resolve(self._filters[depname])
+                    dep = self._filters[depname]
                 except KeyError:
                     raise FilterDependencyError('No such filter: ' + depname)
+                resolve(dep)
+                self._dependencies[filter].add(dep)
             inprocess.remove(filter)
             self._order.append(filter)
             resolved.add(filter)
@@ -1158,17 +1957,19 @@ class FilterStack(object):
     def __iter__(self):
         return iter(self._order)
 
-    def bind(self, state, obj_queue, name='Filter'):
+    def bind(self, state, obj_queue, name='Filter', cpus=None):
         '''Return a FilterStackRunner that can be used to process objects
-        with this filter stack.'''
-        return FilterStackRunner(state, self._order, obj_queue, name)
+        with this filter stack, optionally on the specified CPUs.'''
+        return FilterStackRunner(state, self._order, obj_queue, name,
+                                 self._dependencies, cpus)
 
     def start_threads(self, state, count, scope):
-        '''Start count threads to process objects with this filter stack.'''
+        '''Start count threads to process objects with this filter stack.
+        If configured, a scaler thread later adds and retires workers in
+        the returned list.'''
 
         workers = list()
-        obj_queue = mp.JoinableQueue(1000)
-        obj_queue.cancel_join_thread()  # avoid hanging if workers die first
+        obj_queue = SharedObjectQueue()
 
         def enqueue_scope(q, scope):
             for obj in scope:
@@ -1180,14 +1981,29 @@ class FilterStack(object):
         t = threading.Thread(target=enqueue_scope, args=(obj_queue, scope), name='enqueue-scope-thread')
         t.daemon = True # make sure the whole process terminates when the main thread exits
 
-        for i in range(count):
-            w = self.bind(state, obj_queue, 'Filter-%d' % i)
+        config = state.config
+        placement = CPUPlacement(config.cpu_placement,
+                                 max(count, config.max_threads))
+
+        def start_worker():
+            w = self.bind(state, obj_queue, 'Filter-%d' % len(workers),
+                          placement.cpus(len(workers)))
             w.start()
             _log.debug("Started worker %d", w.pid)
             workers.append(w)
+            state.stats.update(workers_started=1)
+
+        for _i in range(count):
+            start_worker()
 
         t.start()
 
+        if config.max_threads > count:
+            scaler = _WorkerScaler(state, obj_queue, workers, start_worker,
+                                   min(config.min_threads, count),
+                                   config.max_threads)
+            scaler.start()
+
         return workers
 
     def optimize(self):
@@ -1198,7 +2014,8 @@ class FilterStack(object):
             return
 
         new_order = list()
-        seen_digests = set()
+        seen_digests = dict()   # cache_digest -> Filter
+        aliases = dict()    # removed Filter -> identical Filter kept
         for filter in self._order:
             assert isinstance(filter, Filter)
             if not filter.cache_digest:
@@ -1207,13 +2024,23 @@ class FilterStack(object):
                                             "Report to the developer.")
             if filter.cache_digest not in seen_digests:
                 new_order.append(filter)
-                seen_digests.add(filter.cache_digest)
+                seen_digests[filter.cache_digest] = filter
             else:
+                aliases[filter] = seen_digests[filter.cache_digest]
                 _log.info("Filter name %s is removed due to de-duplication.", filter.name)
 
+        # Point dependencies on removed filters at the ones we kept
+        dependencies = dict()
+        for filter in new_order:
+            dependencies[filter] = set(
+                [aliases.get(dep, dep) for dep in self._dependencies[filter]])
+            dependencies[filter].discard(filter)
+
         # commit
         self._order = new_order
+        self._dependencies = dependencies
         self._optimized = True
 
-        # If you are going to add some smartness of static "filter ordering",
-        # work here.
+        # If FILTERREORDER is set, filters are further reordered at runtime
+        # by each FilterStackRunner based on their observed cost and
+        # selectivity.
@@ -0,0 +1,323 @@
+#
+#  The OpenDiamond Platform for Interactive Search
+#
+#  Copyright (c) 2011-2019 Carnegie Mellon University
+#  All rights reserved.
+#
+#  This software is distributed under the terms of the Eclipse Public
+#  License, Version 1.0 which can be found in the file named LICENSE.
+#  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+#  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+#
+
+'''Server-wide pool of initialized filter processes.
+
+Starting a filter process and running its init function (e.g. loading a
+model) can take much longer than evaluating an object, and users often
+rerun nearly identical searches seconds apart.  The supervisor therefore
+forks a pool process which owns filter processes independently of any
+search.  A worker leases a filter process for a Filter by sending its
+cache digest over a Unix socket; the pool replies with the pipes of an idle
+process with the same digest, or of a newly started one.  When the worker
+exits between objects, it returns the process to the pool along with any
+filter output it has read ahead.  If the lease connection closes without a
+release, e.g. because the worker timed out the filter, the process is in
+an unknown state and is killed.
+
+Idle processes are killed after FILTERPOOLIDLE seconds, and the least
+recently used idle processes are killed while the pool exceeds
+FILTERPOOLMEM MB of resident memory.
+
+Only processes with the uid of diamondd may lease filters.  While leased,
+a process is moved into the cgroup of the lessee's search, so that it is
+accounted to the search and killed with it, and it returns to the pool's
+cgroup on release.  Pooled filters keep their TMPDIR and any in-memory
+state across searches, so the pool is disabled unless FILTERPOOLIDLE is
+set.
+
+A leased process is moved to the CPUs of the lessee, so that it follows
+the worker's CPU placement.
+'''
+
+from builtins import object
+from collections import OrderedDict
+import logging
+import os
+import psutil
+import signal
+import simplejson as json
+import socket
+import struct
+from tempfile import mkdtemp
+import threading
+import time
+
+from opendiamond.blobcache import ExecutableBlobCache
+from opendiamond.helpers import recv_fds, send_fds
+from opendiamond.server.child import SEARCH_CGROUP_ENV
+from opendiamond.server.placement import current_cpus, set_process_cpus
+
+# Environment variable giving the pool address to search processes
+FILTER_POOL_ENV = 'DIAMOND_FILTER_POOL'
+# Seconds between checks for idle processes and memory usage
+HOUSEKEEPING_INTERVAL = 10
+# Largest message, including read-ahead filter output returned on release
+MAX_MESSAGE = 64 << 10
+
+_log = logging.getLogger(__name__)
+
+
+class _PooledProcess(object):
+    '''A filter process owned by the pool.'''
+
+    def __init__(self, digest, proc):
+        self.digest = digest
+        self.proc = proc  # _FilterProcess
+        # Whether the filter has reported init-success to a worker
+        self.initialized = False
+        # Filter output read ahead by the previous lessee
+        self.pending = b''
+        self.last_used = time.time()
+
+    @property
+    def fds(self):
+        # pylint: disable=protected-access
+        return [self.proc._proc.stdin.fileno(),
+                self.proc._proc.stdout.fileno()]
+        # pylint: enable=protected-access
+
+    def rss(self):
+        try:
+            proc = psutil.Process(self.proc._proc.pid)  # pylint: disable=protected-access
+            return sum(p.memory_info().rss
+                       for p in [proc] + proc.children(recursive=True))
+        except psutil.Error:
+            return 0
+
+
+class FilterPool(object):
+    '''The pool process and its listening socket.'''
+
+    def __init__(self, config):
+        self._config = config
+        # In the abstract socket namespace
+        self._name = 'opendiamond-filterpool-%d' % os.getpid()
+        self._pid = None
+        self._lock = threading.Lock()
+        # digest -> list of idle _PooledProcess
+        self._idle = dict()
+        # _PooledProcess -> None, least recently released first
+        self._lru = OrderedDict()
+        self._blob_cache = None
+
+    def start(self):
+        '''Fork the pool process and publish its address to searches.'''
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+        sock.bind('\0' + self._name)
+        sock.listen(64)
+        self._pid = os.fork()
+        if self._pid == 0:
+            try:
+                self._run(sock)
+            finally:
+                os._exit(0)  # pylint: disable=protected-access
+        sock.close()
+        os.environ[FILTER_POOL_ENV] = self._name
+        _log.info('Filter pool: pid %d', self._pid)
+
+    def shutdown(self):
+        '''Kill the pool process and its filters.'''
+        if self._pid:
+            try:
+                os.kill(self._pid, signal.SIGTERM)
+            except OSError:
+                pass
+            self._pid = None
+
+    def _run(self, sock):
+        # Undo the supervisor's signal handling
+        for sig in signal.SIGINT, signal.SIGUSR1, signal.SIGCHLD:
+            signal.signal(sig, signal.SIG_DFL)
+        signal.signal(signal.SIGTERM, self._handle_signal)
+        # Filters run in a private directory, as in a search
+        os.environ['TMPDIR'] = mkdtemp(prefix='diamond-filterpool-')
+        self._blob_cache = ExecutableBlobCache(self._config.cachedir)
+        parent = os.getppid()
+
+        housekeeper = threading.Thread(target=self._housekeeping,
+                                       args=(parent,),
+                                       name='filterpool-housekeeping')
+        housekeeper.daemon = True
+        housekeeper.start()
+        try:
+            while True:
+                conn, _addr = sock.accept()
+                thread = threading.Thread(target=self._serve, args=(conn,),
+                                          name='filterpool-lease')
+                thread.daemon = True
+                thread.start()
+        except SystemExit:
+            pass
+        finally:
+            with self._lock:
+                self._idle.clear()
+                self._lru.clear()
+
+    def _handle_signal(self, _sig, _frame):
+        raise SystemExit()
+
+    def _spawn(self, request):
+        # Imported here since filter.py leases processes from the pool
+        from opendiamond.server.filter import _FilterProcess
+        code_path = self._blob_cache.executable_path(request['code'])
+        blob = b''
+        if request['blob'] is not None:
+            blob = self._blob_cache.view(request['blob'])
+        _log.info('Starting pooled filter %s', request['name'])
+        proc = _FilterProcess(code_argv=[code_path], name=request['name'],
+                              args=request['args'], blob=blob)
+        return _PooledProcess(request['digest'], proc)
+
+    def _checkout(self, request):
+        '''Return an idle process for the request, or start one.'''
+        with self._lock:
+            idle = self._idle.get(request['digest'])
+            while idle:
+                entry = idle.pop()
+                del self._lru[entry]
+                # pylint: disable=protected-access
+                if entry.proc._proc.poll() is None:
+                    return entry
+                # pylint: enable=protected-access
+        return self._spawn(request)
+
+    def _move_to_cgroup(self, entry, cgroup):
+        '''Move the process into the specified cgroup directory, which
+        must be within CGROUPDIR.'''
+        root = self._config.cgroupdir
+        if root is None or cgroup is None:
+            return
+        root = os.path.realpath(root)
+        cgroup = os.path.realpath(cgroup)
+        if cgroup != root and not cgroup.startswith(root + os.sep):
+            raise ValueError('cgroup %s is not within %s' % (cgroup, root))
+        # pylint: disable=protected-access
+        pid = entry.proc._proc.pid
+        # pylint: enable=protected-access
+        for name in 'cgroup.procs', 'tasks':
+            path = os.path.join(cgroup, name)
+            if os.path.exists(path):
+                with open(path, 'w') as fh:
+                    fh.write('%d\n' % pid)
+                return
+
+    def _checkin(self, entry):
+        entry.last_used = time.time()
+        with self._lock:
+            self._idle.setdefault(entry.digest, []).append(entry)
+            self._lru[entry] = None
+
+    def _serve(self, conn):
+        '''Lease a filter process over the connection.'''
+        entry = None
+        try:
+            creds = conn.getsockopt(socket.SOL_SOCKET, socket.SO_PEERCRED,
+                                    struct.calcsize('3i'))
+            pid, uid, _gid = struct.unpack('3i', creds)
+            if uid != os.getuid():
+                _log.warning('Refusing filter lease to PID %d, uid %d',
+                             pid, uid)
+                return
+            request = json.loads(conn.recv(MAX_MESSAGE))
+            entry = self._checkout(request)
+            self._move_to_cgroup(entry, request.get('cgroup'))
+            if request.get('cpus'):
+                # pylint: disable=protected-access
+                if not set_process_cpus(entry.proc._proc.pid,
+                                        request['cpus']):
+                    _log.warning('Cannot move pooled filter %s to CPUs %s',
+                                 entry.proc, request['cpus'])
+            reply = json.dumps({
+                'initialized': entry.initialized,
+                'pending': len(entry.pending),
+            }).encode()
+            send_fds(conn, reply + b'\n' + entry.pending, entry.fds)
+            # Wait for release
+            message = conn.recv(MAX_MESSAGE + 1024)
+            if message:
+                header, pending = message.split(b'\n', 1)
+                release = json.loads(header)
+                entry.initialized = release['initialized']
+                entry.pending = pending
+                self._move_to_cgroup(entry, self._config.cgroupdir)
+                self._checkin(entry)
+                entry = None
+        except Exception:  # pylint: disable=broad-except
+            _log.exception('Filter pool lease failed')
+        finally:
+            conn.close()
+            if entry is not None:
+                # Not released.  Kill the process now, so that the lessee
+                # sees end of file if it is still waiting for output.
+                entry.proc.kill()
+
+    def _housekeeping(self, parent):
+        while True:
+            time.sleep(HOUSEKEEPING_INTERVAL)
+            if os.getppid() != parent:
+                # Supervisor died
+                os.kill(os.getpid(), signal.SIGTERM)
+                return
+            expires = time.time() - self._config.filter_pool_idle
+            limit = self._config.filter_pool_memory << 20
+            with self._lock:
+                idle = [(entry, entry.rss()) for entry in self._lru]
+            usage = sum(rss for _entry, rss in idle)
+            evict = []
+            for entry, rss in idle:
+                if entry.last_used < expires or usage > limit:
+                    evict.append(entry)
+                    usage -= rss
+            with self._lock:
+                for entry in evict:
+                    if entry in self._lru:
+                        del self._lru[entry]
+                        self._idle[entry.digest].remove(entry)
+            for entry in evict:
+                _log.info('Evicting pooled filter %s', entry.proc)
+            # Dropping the last reference kills the process
+            del evict, idle
+
+
+def lease_filter(filter):
+    '''Lease a process for the resolved Filter from the pool.  Return
+    (socket, fds, initialized, pending), or None if there is no pool or the
+    lease fails, in which case the caller should start its own process.'''
+    name = os.environ.get(FILTER_POOL_ENV)
+    if name is None:
+        return None
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+    fds = []
+    try:
+        sock.connect('\0' + name)
+        sock.send(json.dumps({
+            'digest': filter.cache_digest,
+            'name': filter.name,
+            'code': filter.signature,
+            'blob': filter.blob_signature,
+            'args': filter.arguments,
+            'cpus': sorted(current_cpus()),
+            'cgroup': os.environ.get(SEARCH_CGROUP_ENV),
+        }).encode())
+        message, fds = recv_fds(sock, MAX_MESSAGE + 1024, 2)
+        if len(fds) != 2:
+            raise IOError('Filter pool refused lease')
+        header, pending = message.split(b'\n', 1)
+        reply = json.loads(header)
+        return sock, fds, reply['initialized'], pending
+    except Exception as e:  # pylint: disable=broad-except
+        _log.warning('Filter pool unavailable for %s: %s', filter.name, e)
+        for fd in fds:
+            os.close(fd)
+        sock.close()
+        return None
@@ -17,8 +17,14 @@ from future import standard_library
 standard_library.install_aliases()
 from builtins import str
 from builtins import object
+from collections import deque
+import ctypes
 from io import BytesIO
 import logging
+import multiprocessing as mp
+from queue import Empty
+import struct
+import threading
 from urllib.parse import urljoin
 import simplejson as json
 
@@ -27,7 +33,7 @@ import pycurl as curl
 import xmltodict
 
 from opendiamond.helpers import murmur, split_scheme
-from opendiamond.protocol import XDR_attribute, XDR_object
+from opendiamond.protocol import XDR_object
 
 ATTR_HEADER_URL = 'x-attributes'
 ATTR_HEADER_PREFIX = 'x-attr-'
@@ -38,6 +44,9 @@ ATTR_OBJ_ID = '_ObjectID'
 ATTR_DISPLAY_NAME = 'Display-Name'
 ATTR_DEVICE_NAME = 'Device-Name'
 
+# Size of the shared-memory ring carrying scope objects to the workers
+SCOPE_QUEUE_BYTES = 4 << 20
+
 # Initialize curl before multiple threads have been started
 curl.global_init(curl.GLOBAL_DEFAULT)
 
@@ -48,6 +57,15 @@ class ObjectLoadError(Exception):
     '''Object failed to load.'''
 
 
+def push_projection(push_attrs):
+    '''Return the set of attributes whose values are sent to the client,
+    given the push attributes requested for a search (None for all).  The
+    object ID is always sent.  Compute this once per search.'''
+    if push_attrs is None:
+        return None
+    return frozenset(push_attrs).union([ATTR_OBJ_ID])
+
+
 class EmptyObject(object):
     '''An immutable Diamond object with no data and no attributes.'''
 
@@ -76,8 +94,17 @@ class EmptyObject(object):
         raise TypeError()
 
     def get_signature(self, key):
-        '''Return the MD5 hash of the attribute value.'''
-        return self._signatures[key]
+        '''Return the murmur() hash of the attribute value, computing it
+        on first use.'''
+        try:
+            return self._signatures[key]
+        except KeyError:
+            signature = self._signature(self._attrs[key])
+            self._signatures[key] = signature
+            return signature
+
+    def _signature(self, value):
+        return murmur(value)
 
     def omit(self, key):
         '''Record that the attribute is not to be returned to the client.'''
@@ -86,39 +113,39 @@ class EmptyObject(object):
         else:
             raise KeyError()
 
-    def xdr_attributes(self, output_set=None, for_drop=False):
-        '''Return a list of XDR_attribute.'''
+    def attribute_pairs(self, projection=None, for_drop=False):
+        '''Return a list of (name, value) pairs to send to the client.
+        projection is None or a set from push_projection(); attributes not
+        in it are sent without values.'''
         if for_drop:
             # Reexecution dropped the object.  Only encode the object ID.
-            send_keys = set([ATTR_OBJ_ID])
-        else:
-            # Don't encode any evidence of omit attributes.
-            send_keys = set(self._attrs.keys()) - self._omit_attrs
-        # If we have an output set, only send values for send_keys that are
-        # in it.  Otherwise, send values for all send_keys.
-        if output_set is not None:
-            # Ensure the object ID is always sent.  Don't modify the output
-            # set in place.
-            output_set = output_set.union([ATTR_OBJ_ID])
-            send_values = send_keys.intersection(output_set)
+            names = [ATTR_OBJ_ID]
         else:
-            send_values = send_keys
-        _log.debug("{}: Sending attrs: {}".format(str(self), ','.join(send_values)))
-        # Serialize
-        attrs = []
-        for name in send_keys:
-            if name in send_values:
-                value = self._attrs[name]
-                if not isinstance(value, bytes):
-                    value = str(value).encode() # to bytes
-            else:
+            names = self._attrs.keys()
+        # Don't encode any evidence of omit attributes.
+        omit = self._omit_attrs
+        pairs = []
+        for name in names:
+            if name in omit:
+                continue
+            if projection is not None and name not in projection:
                 value = b''
-            attrs.append(XDR_attribute(name, value))
-        return attrs
+            else:
+                value = self._attrs[name]
+                if not isinstance(value, (bytes, memoryview)):
+                    value = str(value).encode()  # to bytes
+            pairs.append((name, value))
+        return pairs
 
-    def xdr(self, output_set=None):
-        '''Return an XDR_object.'''
-        return XDR_object(self.xdr_attributes(output_set))
+    def xdr_attributes(self, output_set=None, for_drop=False):
+        '''Return a list of XDR_attribute.'''
+        return XDR_object.from_pairs(
+            self.attribute_pairs(push_projection(output_set),
+                                 for_drop)).attrs
+
+    def xdr(self, projection=None):
+        '''Return an XDR_object.  projection is as for attribute_pairs().'''
+        return XDR_object.from_pairs(self.attribute_pairs(projection))
 
     def debug(self):
         """Print all attributes"""
@@ -156,10 +183,181 @@ class Object(EmptyObject):
 
     def __setitem__(self, key, value):
         self._attrs[key] = value
+        # Computed by get_signature() if the result cache asks for it
+        self._signatures.pop(key, None)
+
+    def set_with_signature(self, key, value, signature):
+        '''Set an attribute whose signature is already known, e.g. because
+        it was loaded from the attribute cache.'''
+        self._attrs[key] = value
+        self._signatures[key] = signature
+
+    def _signature(self, value):
         if self._compute_signature:
-            self._signatures[key] = murmur(value)
-        else:
-            self._signatures[key] = 0
+            return murmur(value)
+        return 0
+
+    def pack(self):
+        '''Return a compact bytes encoding of the object ID, src and meta
+        URIs, and attributes, for handing the object to another process.
+        Omit attributes are not preserved.'''
+        fields = [self._id.encode(),
+                  str(getattr(self, 'src', '')).encode(),
+                  str(getattr(self, 'meta', '')).encode(),
+                  b'1' if self._compute_signature else b'0']
+        for key, value in self._attrs.items():
+            fields.append(key.encode())
+            if isinstance(value, (bytes, memoryview)):
+                fields.append(b'b' + value)
+            else:
+                fields.append(b's' + str(value).encode())
+        return b''.join([struct.pack('!I', len(f)) + f for f in fields])
+
+    @classmethod
+    def unpack(cls, data):
+        '''Return an Object from the output of pack().'''
+        fields = []
+        offset = 0
+        while offset < len(data):
+            length, = struct.unpack_from('!I', data, offset)
+            offset += 4
+            fields.append(data[offset:offset + length])
+            offset += length
+        obj = cls.__new__(cls)
+        EmptyObject.__init__(obj)
+        obj._id = fields[0].decode()
+        if fields[1]:
+            obj.src = fields[1].decode()
+        if fields[2]:
+            obj.meta = fields[2].decode()
+        obj._compute_signature = fields[3] == b'1'
+        for i in range(4, len(fields), 2):
+            value = fields[i + 1]
+            if value[:1] == b'b':
+                obj[fields[i].decode()] = value[1:]
+            else:
+                obj[fields[i].decode()] = value[1:].decode()
+        return obj
+
+
+def _new_curl(config):
+    '''Return a Curl handle configured for talking to dataretrievers.'''
+    c = curl.Curl()
+    c.setopt(curl.NOSIGNAL, 1)
+    c.setopt(curl.FAILONERROR, 1)
+    c.setopt(curl.USERAGENT, config.user_agent)
+    if config.http_proxy is not None:
+        c.setopt(curl.PROXY, config.http_proxy)
+    return c
+
+
+def _parse_header(headers, hdr):
+    '''Update the headers dict with a raw header line.'''
+    hdr = hdr.decode()  # to str
+    hdr = hdr.rstrip('\r\n')
+    if hdr.startswith('HTTP/'):
+        # New HTTP status line, discard existing headers
+        headers.clear()
+    elif hdr != '':
+        # This is simplistic.
+        key, value = hdr.split(': ', 1)
+        headers[key] = value.encode()  # value to bytes
+
+
+class SharedObjectQueue(object):
+    '''A multi-process queue of Objects backed by a shared-memory ring
+    buffer, with the put()/get()/task_done()/join() interface of
+    multiprocessing.JoinableQueue.
+
+    Objects are stored in the output format of Object.pack(), preceded by
+    their length, and are copied in and out of the ring under a lock
+    shared with the consumer processes.  Unlike JoinableQueue there is no
+    pickling and no feeder thread.  Must be created before the consumer
+    processes are forked.'''
+
+    def __init__(self, capacity=SCOPE_QUEUE_BYTES):
+        self._capacity = capacity
+        self._buf = mp.RawArray(ctypes.c_ubyte, capacity)
+        self._ring = memoryview(self._buf).cast('B')
+        # Byte offsets of the first used and first free byte, modulo
+        # capacity
+        self._head = mp.RawValue(ctypes.c_ulonglong, 0)
+        self._tail = mp.RawValue(ctypes.c_ulonglong, 0)
+        self._count = mp.RawValue(ctypes.c_uint, 0)
+        self._unfinished = mp.RawValue(ctypes.c_uint, 0)
+        self._lock = mp.Lock()
+        self._not_empty = mp.Condition(self._lock)
+        self._not_full = mp.Condition(self._lock)
+        self._all_done = mp.Condition(self._lock)
+
+    def _write(self, offset, data):
+        ring = self._ring
+        start = offset % self._capacity
+        first = min(len(data), self._capacity - start)
+        ring[start:start + first] = data[:first]
+        ring[0:len(data) - first] = data[first:]
+
+    def _read(self, offset, length):
+        ring = self._ring
+        start = offset % self._capacity
+        first = min(length, self._capacity - start)
+        return ring[start:start + first].tobytes() + \
+            ring[0:length - first].tobytes()
+
+    def put(self, obj):
+        '''Add the Object to the queue, blocking while the ring is full.'''
+        data = obj.pack()
+        data = struct.pack('!I', len(data)) + data
+        if len(data) > self._capacity:
+            raise ValueError('Object too large for queue: %s' % obj)
+        with self._not_full:
+            while (self._capacity - (self._tail.value - self._head.value) <
+                   len(data)):
+                self._not_full.wait()
+            self._write(self._tail.value, data)
+            self._tail.value += len(data)
+            self._count.value += 1
+            self._unfinished.value += 1
+            self._not_empty.notify()
+
+    def get(self, block=True, timeout=None):
+        '''Remove and return an Object from the queue.'''
+        with self._not_empty:
+            while self._count.value == 0:
+                if not block:
+                    raise Empty()
+                if not self._not_empty.wait(timeout):
+                    raise Empty()
+            length, = struct.unpack('!I', self._read(self._head.value, 4))
+            data = self._read(self._head.value + 4, length)
+            self._head.value += 4 + length
+            self._count.value -= 1
+            self._not_full.notify()
+        return Object.unpack(data)
+
+    def get_nowait(self):
+        return self.get(False)
+
+    def fill(self):
+        '''Return the fraction of the ring in use.'''
+        with self._lock:
+            return (float(self._tail.value - self._head.value) /
+                    self._capacity)
+
+    def task_done(self):
+        '''Indicate that an Object returned by get() has been processed.'''
+        with self._all_done:
+            if self._unfinished.value == 0:
+                raise ValueError('task_done() called too many times')
+            self._unfinished.value -= 1
+            if self._unfinished.value == 0:
+                self._all_done.notify_all()
+
+    def join(self):
+        '''Block until every Object put() has been marked task_done().'''
+        with self._all_done:
+            while self._unfinished.value:
+                self._all_done.wait()
 
 
 class _HttpLoader(object):
@@ -167,19 +365,20 @@ class _HttpLoader(object):
     connections.  Must not be used by more than one thread.'''
 
     def __init__(self, config):
-        self._curl = curl.Curl()
-        self._curl.setopt(curl.NOSIGNAL, 1)
-        self._curl.setopt(curl.FAILONERROR, 1)
-        self._curl.setopt(curl.USERAGENT, config.user_agent)
-        if config.http_proxy is not None:
-            self._curl.setopt(curl.PROXY, config.http_proxy)
+        self._curl = _new_curl(config)
         self._curl.setopt(curl.HEADERFUNCTION, self._handle_header)
         self._curl.setopt(curl.WRITEFUNCTION, self._handle_body)
         self._headers = {}
         self._body = BytesIO()
+        # url -> (header_dict, body) already fetched by an ObjectPrefetcher
+        self.prefetched = {}
 
     def get(self, url):
         '''Fetch the specified URL and return (header_dict, body).'''
+        try:
+            return self.prefetched.pop(url)
+        except KeyError:
+            pass
         # Perform the fetch
         self._curl.setopt(curl.URL, url)
         try:
@@ -194,15 +393,7 @@ class _HttpLoader(object):
         return (headers, body)
 
     def _handle_header(self, hdr):
-        hdr = hdr.decode()  # to str
-        hdr = hdr.rstrip('\r\n')
-        if hdr.startswith('HTTP/'):
-            # New HTTP status line, discard existing headers
-            self._headers = {}
-        elif hdr != '':
-            # This is simplistic.
-            key, value = hdr.split(': ', 1)
-            self._headers[key] = value.encode() # value to bytes
+        _parse_header(self._headers, hdr)
 
     def _handle_body(self, data):
         self._body.write(data)
@@ -238,6 +429,12 @@ class ObjectLoader(object):
         # Assume we can always load other types of URLs
         return True
 
+    def preload(self, responses):
+        '''Supply the url -> (header_dict, body) responses prefetched for
+        the next object to be loaded.  Responses left over from the
+        previous object are discarded.'''
+        self._http.prefetched = responses
+
     def load(self, obj):
         '''Retrieve the Object and update it with the information we
         receive.'''
@@ -271,7 +468,7 @@ class ObjectLoader(object):
     def _load_blobcache(self, obj, signature):
         # Load the object data
         try:
-            obj[ATTR_DATA] = self._blob_cache[signature]
+            obj[ATTR_DATA] = self._blob_cache.view(signature)
         except KeyError:
             raise ObjectLoadError('Object not in cache')
 
@@ -286,7 +483,7 @@ class ObjectLoader(object):
                 obj[key] = value + '\0'
         # Fetch additional initial attributes if specified
         if ATTR_HEADER_URL in headers:
-            attr_url = urljoin(url, headers[ATTR_HEADER_URL])
+            attr_url = urljoin(url, headers[ATTR_HEADER_URL].decode())
             self._load_attributes(obj, attr_url)
 
     def _load_localfile(self, obj, path):
@@ -343,3 +540,242 @@ class ObjectLoader(object):
                 if '@meta' in object_el['object']:
                     obj.meta = urljoin(uri, object_el['object']['@meta'])
         return
+
+
+class _PrefetchRequest(object):
+    '''A pending prefetch of one URL on behalf of an object.'''
+
+    def __init__(self, entry, url, kind):
+        self.entry = entry
+        self.url = url
+        self.kind = kind  # 'object', 'meta', 'src', or 'attributes'
+        self.headers = {}
+        self.body = BytesIO()
+
+
+class _PrefetchEntry(object):
+    '''An object whose dataretriever responses are being prefetched.'''
+
+    def __init__(self, obj):
+        self.obj = obj
+        self.responses = {}  # url -> (header_dict, body)
+        self.pending = 0
+        self.size = 0
+
+
+class ObjectPrefetcher(object):
+    '''Pulls upcoming objects from the scope queue and fetches their
+    dataretriever responses ahead of time, so that ObjectLoader.load()
+    rarely has to wait on the network.
+
+    A background thread keeps up to depth objects in flight over a single
+    CurlMulti, which reuses keep-alive connections across requests.  Only
+    HTTP requests are prefetched; blob cache and local file objects are
+    passed through untouched.  Once prefetched responses reach max_bytes,
+    no new objects are started until the consumer catches up.  Failed
+    requests are simply not recorded, so that ObjectLoader retries them
+    and reports the error in the usual way.
+
+    After stop(), get() returns the objects already taken from the queue
+    and then raises Empty.  If the prefetch thread fails, get() returns the
+    objects it had taken, with whatever responses it had received, and then
+    takes objects from the queue itself, leaving ObjectLoader to fetch
+    them.'''
+
+    def __init__(self, config, obj_queue, depth, max_bytes):
+        self._config = config
+        self._obj_queue = obj_queue
+        self._depth = depth
+        self._max_bytes = max_bytes
+        self._cond = threading.Condition()
+        self._ready = deque()  # completed _PrefetchEntry
+        self._buffered = 0  # bytes held by self._ready and active entries
+        self._multi = None
+        self._free_curls = []
+        self._handles = set()  # Curl handles in self._multi
+        self._thread = None
+        self._stopping = False
+        # Set if the prefetch thread died
+        self._failed = False
+
+    def start(self):
+        '''Start the prefetch thread.  Must be called from the process
+        which will consume the objects.'''
+        self._multi = curl.CurlMulti()
+        self._multi.setopt(curl.M_MAXCONNECTS, 2 * self._depth)
+        self._thread = threading.Thread(target=self._run,
+                                        name='prefetch-thread')
+        self._thread.daemon = True
+        self._thread.start()
+
+    def stop(self):
+        '''Stop taking objects from the queue.  Objects with unfinished
+        transfers are handed over with the responses received so far.'''
+        with self._cond:
+            self._stopping = True
+            self._cond.notify_all()
+        self._thread.join()
+
+    def get(self, block=True):
+        '''Return the next (Object, responses) pair, blocking until one is
+        available unless block is False.  responses is suitable for
+        ObjectLoader.preload().'''
+        with self._cond:
+            while not self._ready:
+                if self._failed and not self._stopping:
+                    break
+                if not block:
+                    raise Empty()
+                self._cond.wait()
+            if self._ready:
+                entry = self._ready.popleft()
+                self._buffered -= entry.size
+                self._cond.notify_all()
+                return entry.obj, entry.responses
+        # Prefetching failed; load objects without it
+        return self._obj_queue.get(block), None
+
+    def _request(self, entry, url, kind):
+        req = _PrefetchRequest(entry, url, kind)
+        try:
+            c = self._free_curls.pop()
+        except IndexError:
+            c = _new_curl(self._config)
+        c.setopt(curl.URL, url)
+        c.setopt(curl.HEADERFUNCTION,
+                 lambda hdr: _parse_header(req.headers, hdr))
+        c.setopt(curl.WRITEFUNCTION, req.body.write)
+        c.request = req
+        entry.pending += 1
+        self._multi.add_handle(c)
+        self._handles.add(c)
+
+    def _start_object(self, entry):
+        obj = entry.obj
+        if not hasattr(obj, 'src'):
+            scheme, _ = split_scheme(str(obj))
+            if scheme != 'sha256':
+                self._request(entry, str(obj), 'object')
+        else:
+            self._request_content(entry)
+
+    def _request_content(self, entry):
+        obj = entry.obj
+        if hasattr(obj, 'meta'):
+            scheme, _ = split_scheme(str(obj.meta))
+            if scheme != 'file':
+                self._request(entry, str(obj.meta), 'meta')
+        scheme, _ = split_scheme(str(obj.src))
+        if scheme not in ('sha256', 'file'):
+            self._request(entry, str(obj.src), 'src')
+
+    def _finish_request(self, c, ok):
+        self._multi.remove_handle(c)
+        self._handles.discard(c)
+        req = c.request
+        del c.request
+        self._free_curls.append(c)
+        entry = req.entry
+        entry.pending -= 1
+        if not ok:
+            return
+        body = req.body.getvalue()
+        if req.kind == 'object':
+            # Same resolution as ObjectLoader._load_src_maybe_meta()
+            try:
+                object_el = xmltodict.parse(body)
+                entry.obj.src = urljoin(req.url, object_el['object']['@src'])
+                if '@meta' in object_el['object']:
+                    entry.obj.meta = urljoin(req.url,
+                                             object_el['object']['@meta'])
+            except Exception:  # pylint: disable=broad-except
+                # Leave it to the loader to fail on this object
+                return
+            self._request_content(entry)
+            return
+        entry.responses[req.url] = (req.headers, body)
+        entry.size += len(body)
+        with self._cond:
+            self._buffered += len(body)
+        if req.kind == 'src' and ATTR_HEADER_URL in req.headers:
+            attr_url = urljoin(req.url, req.headers[ATTR_HEADER_URL].decode())
+            self._request(entry, attr_url, 'attributes')
+
+    def _run(self):
+        active = []
+        try:
+            self._prefetch(active)
+        except Exception:  # pylint: disable=broad-except
+            _log.exception('Prefetching failed; loading objects directly')
+            with self._cond:
+                self._failed = True
+
+        # Abandon unfinished transfers
+        for c in list(self._handles):
+            try:
+                self._finish_request(c, False)
+            except Exception:  # pylint: disable=broad-except
+                self._handles.discard(c)
+        # Hand the objects we took to the consumer
+        with self._cond:
+            self._ready.extend(active)
+            self._cond.notify_all()
+
+    def _prefetch(self, active):
+        '''Prefetch until stopped.  active is the list of objects taken
+        from the queue and not yet handed to the consumer.'''
+        while not self._stopping:
+            # Start new objects while we have room.  Objects waiting for
+            # the consumer count against the depth, so that we don't take
+            # objects other workers could be processing.
+            while True:
+                with self._cond:
+                    if len(active) + len(self._ready) >= self._depth:
+                        if not active and not self._stopping:
+                            # Wait for the consumer
+                            self._cond.wait(0.5)
+                        break
+                    if self._buffered >= self._max_bytes:
+                        if active:
+                            break
+                        while (self._buffered >= self._max_bytes and
+                               not self._stopping):
+                            self._cond.wait()
+                    if self._stopping:
+                        break
+                try:
+                    if active:
+                        obj = self._obj_queue.get_nowait()
+                    else:
+                        # Time out to notice stop()
+                        obj = self._obj_queue.get(timeout=0.5)
+                except Empty:
+                    break
+                entry = _PrefetchEntry(obj)
+                active.append(entry)
+                self._start_object(entry)
+
+            # Make progress on transfers
+            while True:
+                ret, _ = self._multi.perform()
+                if ret != curl.E_CALL_MULTI_PERFORM:
+                    break
+            while True:
+                _, ok_list, err_list = self._multi.info_read()
+                for c in ok_list:
+                    self._finish_request(c, True)
+                for c, _errno, _errmsg in err_list:
+                    self._finish_request(c, False)
+                if not ok_list and not err_list:
+                    break
+
+            # Hand completed objects to the consumer
+            done = [entry for entry in active if entry.pending == 0]
+            if done:
+                with self._cond:
+                    for entry in done:
+                        active.remove(entry)
+                        self._ready.append(entry)
+                    self._cond.notify_all()
+            if active:
+                self._multi.select(0.1)
@@ -0,0 +1,141 @@
+#
+#  The OpenDiamond Platform for Interactive Search
+#
+#  Copyright (c) 2011-2019 Carnegie Mellon University
+#  All rights reserved.
+#
+#  This software is distributed under the terms of the Eclipse Public
+#  License, Version 1.0 which can be found in the file named LICENSE.
+#  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+#  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+#
+
+'''Placement of search workers on CPUs.
+
+The CPUPLACEMENT policy decides where the worker processes of a search,
+and the filter processes they start, may run:
+
+none    Leave placement to the kernel scheduler.
+numa    Pin each worker to the CPUs of one NUMA node, assigning nodes
+        round-robin.  Since Linux allocates memory on the node of the
+        allocating CPU, a worker, its filters, and the object data they
+        hold stay on one node.
+cores   Divide the CPUs into disjoint sets, one per worker, without
+        splitting sets across NUMA nodes.
+
+Only the CPUs allowed to the search process are used, so placement
+composes with a cpuset cgroup configured through CGROUPDIR.  Filter
+processes inherit their worker's CPUs, pooled filter processes are moved
+to the CPUs of the worker leasing them, and Docker filters are started
+with a matching cpuset.
+'''
+
+from builtins import object
+import logging
+import os
+
+PLACEMENT_POLICIES = ('none', 'numa', 'cores')
+_NODE_DIR = '/sys/devices/system/node'
+
+_log = logging.getLogger(__name__)
+
+
+def parse_cpulist(text):
+    '''Parse a kernel CPU list such as "0-3,8,10-11" into a set.'''
+    cpus = set()
+    for part in text.strip().split(','):
+        if not part:
+            continue
+        first, _sep, last = part.partition('-')
+        cpus.update(range(int(first), int(last or first) + 1))
+    return cpus
+
+
+def format_cpulist(cpus):
+    '''Format a set of CPUs as a kernel CPU list.'''
+    ranges = []
+    for cpu in sorted(cpus):
+        if ranges and ranges[-1][1] == cpu - 1:
+            ranges[-1][1] = cpu
+        else:
+            ranges.append([cpu, cpu])
+    return ','.join(str(first) if first == last else '%d-%d' % (first, last)
+                    for first, last in ranges)
+
+
+def _numa_nodes():
+    '''Return a list of the CPU sets of NUMA nodes, or [] if unknown.'''
+    try:
+        names = os.listdir(_NODE_DIR)
+    except OSError:
+        return []
+    nodes = []
+    for name in sorted(names):
+        if not name.startswith('node') or not name[4:].isdigit():
+            continue
+        try:
+            with open(os.path.join(_NODE_DIR, name, 'cpulist')) as fh:
+                cpus = parse_cpulist(fh.read())
+        except (IOError, ValueError):
+            continue
+        if cpus:
+            nodes.append(cpus)
+    return nodes
+
+
+def current_cpus():
+    '''Return the CPUs the calling process may run on.'''
+    return os.sched_getaffinity(0)
+
+
+def set_process_cpus(pid, cpus):
+    '''Restrict all threads of a process to the given CPUs.  Return False
+    if that is not possible.'''
+    try:
+        tids = [int(tid) for tid in os.listdir('/proc/%d/task' % pid)]
+    except OSError:
+        tids = [pid]
+    try:
+        for tid in tids:
+            os.sched_setaffinity(tid, cpus)
+    except OSError:
+        return False
+    return True
+
+
+class CPUPlacement(object):
+    '''Assigns CPU sets to the workers of a search.'''
+
+    def __init__(self, policy, workers):
+        if policy not in PLACEMENT_POLICIES:
+            raise ValueError('Unknown CPU placement policy: %s' % policy)
+        self.policy = policy
+        # CPU sets, assigned round-robin by worker index
+        self._sets = []
+        if policy == 'none':
+            return
+
+        allowed = current_cpus()
+        nodes = [node & allowed for node in _numa_nodes()]
+        nodes = [node for node in nodes if node] or [allowed]
+        if policy == 'numa':
+            self._sets = nodes
+        else:
+            # Split each node's CPUs among its share of the workers
+            workers = max(workers, 1)
+            for node in nodes:
+                cpus = sorted(node)
+                share = min(len(cpus),
+                            -(-workers * len(cpus) // len(allowed)))
+                for i in range(share):
+                    self._sets.append(set(cpus[i * len(cpus) // share:
+                                               (i + 1) * len(cpus) // share]))
+        _log.info('CPU placement %s: %s', policy,
+                  ' '.join(format_cpulist(cpus) for cpus in self._sets))
+
+    def cpus(self, index):
+        '''Return the CPU set for the worker with the given index, or None
+        if placement is disabled.'''
+        if not self._sets:
+            return None
+        return self._sets[index % len(self._sets)]
@@ -10,23 +10,63 @@
 #  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
 #
 
-'''Scope list retrieval, parsing, and iteration.'''
+'''Scope list retrieval, parsing, and iteration.
+
+Scope lists are XML documents of the form
+
+    <objectlist count="N">
+      <count adjust="M" />
+      <object id="URL" src="URL" meta="URL" attribute="value" ... />
+      ...
+    </objectlist>
+
+Dataretrievers may instead return a compact binary format, with Content-Type
+application/x-diamond-scope, when our Accept header allows it.  It consists
+of the magic number "DSC1" followed by records of a one-byte type, a 32-bit
+big-endian payload length, and the payload:
+
+    'C'  count adjustment, as a 64-bit big-endian signed integer
+    'O'  object, as alternating NUL-terminated attribute names and values
+    'E'  end of scope list
+
+Both formats are parsed by the native opendiamond._scopelist parser if it
+was built.
+
+Up to scope_fetchers scope lists are fetched concurrently, and their objects
+are interleaved in the order they arrive.
+'''
 
 from __future__ import with_statement
 from future import standard_library
 standard_library.install_aliases()
 from builtins import next
 from builtins import object
+from collections import deque
 import logging
+from queue import Queue
+import re
+import struct
 import urllib.request, urllib.error, urllib.parse
-from urllib.parse import urljoin
+from urllib.parse import urljoin, urlsplit
 import threading
 from xml.sax import make_parser, SAXParseException
 from xml.sax.handler import ContentHandler
 
+from opendiamond.dataretriever.util import (SCOPE_BINARY_MAGIC,
+                                            SCOPE_BINARY_TYPE)
 from opendiamond.server.object_ import Object
 
+try:
+    from opendiamond import _scopelist
+except ImportError:
+    _scopelist = None
+
 BASE_URL = 'http://localhost:5873/'
+# Size of reads from the scope list connection
+SCOPE_READ_SIZE = 256 << 10
+SCOPE_ACCEPT = '%s, text/xml;q=0.9, */*;q=0.1' % SCOPE_BINARY_TYPE
+# Parsed reads each scope list fetcher may buffer ahead of the workers
+SCOPE_BUFFER_CHUNKS = 4
 
 _log = logging.getLogger(__name__)
 
@@ -50,10 +90,132 @@ class _ScopeListHandler(ContentHandler):
         elif name == 'count':
             self.count += int(attrs['adjust'])
         elif name == 'object':
-            self.pending_objects.append(dict(attrs))
+            attrs = dict(attrs)
+            self.pending_objects.append((attrs.pop('id', None),
+                                         attrs.pop('src', None),
+                                         attrs.pop('meta', None),
+                                         attrs or None))
             # pylint: enable=invalid-name
 
 
+class _XMLScopeParser(object):
+    '''SAX fallback for the native parser, with the same interface.'''
+
+    def __init__(self):
+        self._handler = _ScopeListHandler()
+        self._parser = make_parser()
+        self._parser.setContentHandler(self._handler)
+
+    @property
+    def count(self):
+        return self._handler.count
+
+    def feed(self, data):
+        try:
+            self._parser.feed(data)
+        except SAXParseException as e:
+            raise ValueError(str(e))
+        entries = self._handler.pending_objects
+        self._handler.pending_objects = []
+        return entries
+
+    def close(self):
+        try:
+            self._parser.close()
+        except SAXParseException:
+            # Received malformed XML, such as XML with missing closing
+            # tags.  This is likely caused by a prematurely-terminated
+            # connection.
+            raise ValueError('incomplete scope list')
+
+
+class _BinaryScopeParser(object):
+    '''Python fallback for the native binary scope list parser.'''
+
+    def __init__(self):
+        self.count = 0
+        self._buf = b''
+        self._started = False
+        self._finished = False
+
+    def feed(self, data):
+        buf = self._buf + data
+        if not self._started:
+            if len(buf) < len(SCOPE_BINARY_MAGIC):
+                self._buf = buf
+                return []
+            if not buf.startswith(SCOPE_BINARY_MAGIC):
+                raise ValueError('bad magic number')
+            buf = buf[len(SCOPE_BINARY_MAGIC):]
+            self._started = True
+        entries = []
+        pos = 0
+        while len(buf) - pos >= 5:
+            type_, length = struct.unpack_from('>cI', buf, pos)
+            if len(buf) - pos - 5 < length:
+                break
+            if self._finished:
+                raise ValueError('data after end record')
+            payload = buf[pos + 5:pos + 5 + length]
+            pos += 5 + length
+            if type_ == b'C':
+                self.count += struct.unpack('>q', payload)[0]
+            elif type_ == b'O':
+                fields = payload.decode().split('\0')
+                if len(fields) % 2 != 1 or fields[-1]:
+                    raise ValueError('bad object record')
+                attrs = dict(zip(fields[:-1:2], fields[1:-1:2]))
+                entries.append((attrs.pop('id', None), attrs.pop('src', None),
+                                attrs.pop('meta', None), attrs or None))
+            elif type_ == b'E':
+                self._finished = True
+            else:
+                raise ValueError('unknown record type')
+        self._buf = buf[pos:]
+        return entries
+
+    def close(self):
+        if not self._finished:
+            raise ValueError('incomplete scope list')
+        if self._buf:
+            raise ValueError('junk after end of scope list')
+
+
+def _make_parser(binary):
+    if _scopelist is not None:
+        return _scopelist.Parser(binary)
+    elif binary:
+        return _BinaryScopeParser()
+    else:
+        return _XMLScopeParser()
+
+
+class _URLResolver(object):
+    '''urljoin() against a fixed base URL, with fast paths for the
+    references found in scope lists.'''
+
+    # References which need the general algorithm: those with a scheme,
+    # network-path references, and those with dot segments, a query, or a
+    # fragment
+    _SLOW = re.compile(r'^[^/?#]*:|^//|^\.|^[?#]|^$')
+
+    def __init__(self, base):
+        self._base = base
+        parts = urlsplit(base)
+        self._origin = '%s://%s' % (parts.scheme, parts.netloc)
+        path = parts.path or '/'
+        self._directory = self._origin + path[:path.rfind('/') + 1]
+        self._fast = parts.scheme in ('http', 'https') and parts.netloc
+
+    def __call__(self, ref):
+        if not self._fast or self._SLOW.match(ref) or '/.' in ref:
+            return urljoin(self._base, ref)
+        elif ref.startswith('/'):
+            return self._origin + ref
+        else:
+            return self._directory + ref
+
+
 class ScopeListLoader(object):
     '''Iterator over the objects in the scope lists referenced by the scope
     cookies.'''
@@ -63,7 +225,11 @@ class ScopeListLoader(object):
         self.cookies = cookies
         self._config = config
         self._lock = threading.Lock()
-        self._handler = _ScopeListHandler()
+        # (count from finished scope lists, parsers of scope lists being
+        # fetched), replaced atomically so that get_count() needs no lock
+        self._counts = (0, ())
+        # Serializes replacement of _counts by fetcher threads
+        self._counts_lock = threading.Lock()
         self._generator = self._generator_func()
 
     def __iter__(self):
@@ -72,24 +238,20 @@ class ScopeListLoader(object):
     def __next__(self):
         '''Return the next Object.'''
         with self._lock:
-            pending_object, scope_url = next(self._generator)
-
-        id = pending_object.pop('id', None)
-        src = pending_object.pop('src', None)
-        meta = pending_object.pop('meta', None)
+            (id, src, meta, extra), resolve = next(self._generator)
 
         # Allow 'src' and 'meta' be missing
-        # If so, they should be loaded later in ObjectLoader        
+        # If so, they should be loaded later in ObjectLoader
         if src:
-            src = urljoin(scope_url, src)
+            src = resolve(src)
         if meta:
-            meta = urljoin(scope_url, meta)
+            meta = resolve(meta)
 
         # 'src' is the fallback value for 'id' for backward
         # compatibility (f.i. scopelists from Algum)
         # id can't be None eventually
         if id:
-            id = urljoin(scope_url, id)
+            id = resolve(id)
         elif src:
             id = src
         else:
@@ -103,8 +265,9 @@ class ScopeListLoader(object):
                             compute_signature=(self._config.cache_server is not None))
 
         # use the remaining attrs as normal object attributes
-        for k, v in pending_object.items():
-            new_obj[k] = v + '\0'
+        if extra:
+            for k, v in extra.items():
+                new_obj[k] = v + '\0'
 
         return new_obj
 
@@ -118,48 +281,95 @@ class ScopeListLoader(object):
             }))
         opener = urllib.request.build_opener(*handlers)
         opener.addheaders = [('User-Agent', self._config.user_agent)]
-        # Build XML parser
-        parser = make_parser()
-        parser.setContentHandler(self._handler)
-        # Walk scope URLs
+        # Start fetchers.  Each takes scope URLs in order and queues
+        # (entries, resolver, slots) for each read, or (None, None, error)
+        # when it runs out of URLs.
+        urls = deque(urljoin(BASE_URL, url)
+                     for cookie in self.cookies for url in cookie)
+        chunks = Queue()
+        fetchers = max(1, min(self._config.scope_fetchers, len(urls)))
+        for i in range(fetchers):
+            thread = threading.Thread(target=self._fetcher,
+                                      name='scope-fetcher-%d' % i,
+                                      args=(opener, urls, chunks))
+            thread.daemon = True
+            thread.start()
+        # Interleave objects from the fetchers
         count = 0
-        for scope_url in (url for cookie in self.cookies for url in cookie):
-            scope_url = urljoin(BASE_URL, scope_url)
-            try:
-                # We use urllib2 here because different parts of a single
-                # HTTP response will be handled from different threads.
-                # pycurl does not support this.
-                fh = opener.open(scope_url)
-                # Read the scope list in 4 KB chunks
-                while True:
-                    buf = fh.read(4096)
-                    if not buf:
-                        break
-                    parser.feed(buf)
-                    while self._handler.pending_objects:
-                        pending_object = self._handler.pending_objects.pop(0)
-                        count += 1
-                        yield (pending_object, scope_url)
-
-            except urllib.error.URLError as e:
-                _log.warning('Fetching %s: %s', scope_url, e)
-            except SAXParseException as e:
-                _log.warning('Parsing %s: %s', scope_url, e)
-            finally:
-                try:
-                    parser.close()
-                except SAXParseException:
-                    # Received malformed XML, such as XML with missing
-                    # closing tags.  This is likely caused by a
-                    # prematurely-terminated connection.
-                    _log.warning('Parsing %s: incomplete scope list',
-                                 scope_url)
-                parser.reset()
+        while fetchers:
+            entries, resolve, slots = chunks.get()
+            if entries is None:
+                fetchers -= 1
+                if slots is not None:
+                    raise slots
+                continue
+            slots.release()
+            for entry in entries:
+                count += 1
+                yield (entry, resolve)
         # Log successful completion
         _log.info('End of scope list (%d)', count)
 
+    def _fetcher(self, opener, urls, chunks):
+        # Bounds the reads buffered by this fetcher
+        slots = threading.Semaphore(SCOPE_BUFFER_CHUNKS)
+        error = None
+        try:
+            while True:
+                try:
+                    scope_url = urls.popleft()
+                except IndexError:
+                    break
+                self._fetch(opener, scope_url, chunks, slots)
+        except Exception as e:  # pylint: disable=broad-except
+            # Raise it from the iterator, as if we weren't a thread
+            error = e
+        finally:
+            chunks.put((None, None, error))
+
+    def _fetch(self, opener, scope_url, chunks, slots):
+        parser = None
+        try:
+            # We use urllib2 here because different parts of a single
+            # HTTP response will be handled from different threads.
+            # pycurl does not support this.
+            fh = opener.open(urllib.request.Request(
+                scope_url, headers={'Accept': SCOPE_ACCEPT}))
+            binary = (fh.headers.get_content_type() == SCOPE_BINARY_TYPE)
+            parser = _make_parser(binary)
+            self._update_counts(add=parser)
+            resolve = _URLResolver(scope_url)
+            # Don't wait for a full buffer from slow dataretrievers
+            read = getattr(fh, 'read1', fh.read)
+            while True:
+                buf = read(SCOPE_READ_SIZE)
+                if not buf:
+                    break
+                entries = parser.feed(buf)
+                if entries:
+                    slots.acquire()
+                    chunks.put((entries, resolve, slots))
+            parser.close()
+        except urllib.error.URLError as e:
+            _log.warning('Fetching %s: %s', scope_url, e)
+        except ValueError as e:
+            _log.warning('Parsing %s: %s', scope_url, e)
+        finally:
+            if parser is not None:
+                self._update_counts(remove=parser)
+
+    def _update_counts(self, add=None, remove=None):
+        with self._counts_lock:
+            base, parsers = self._counts
+            if add is not None:
+                parsers += (add,)
+            if remove is not None:
+                base += remove.count
+                parsers = tuple(p for p in parsers if p is not remove)
+            self._counts = (base, parsers)
+
     def get_count(self):
         '''Return our current understanding of the number of objects in
         scope.'''
-        with self._lock:
-            return self._handler.count
+        base, parsers = self._counts
+        return base + sum(parser.count for parser in parsers)
@@ -18,8 +18,10 @@ from functools import wraps
 import logging
 import multiprocessing as mp
 import os
+from queue import Queue, Empty
 import signal
 import threading
+import time
 
 from opendiamond import protocol
 from opendiamond.blobcache import ExecutableBlobCache
@@ -29,8 +31,10 @@ from opendiamond.protocol import (
 from opendiamond.rpc import RPCHandlers, RPCError, RPCProcedureUnavailable
 from opendiamond.scope import ScopeCookie, ScopeError, ScopeCookieExpired
 from opendiamond.server.filter import (
-    FilterStack, Filter, FilterDependencyError, FilterUnsupportedSource)
-from opendiamond.server.object_ import EmptyObject, Object, ObjectLoader
+    CACHE_FLUSH_TIMEOUT, FilterStack, Filter, FilterDependencyError,
+    FilterUnsupportedSource)
+from opendiamond.server.object_ import (EmptyObject, Object, ObjectLoader,
+                                         push_projection)
 from opendiamond.server.scopelist import ScopeListLoader
 from opendiamond.server.sessionvars import SessionVariables
 from opendiamond.server.statistics import SearchStatistics
@@ -48,6 +52,8 @@ class SearchState(object):
         self.session_vars = SessionVariables()
         self.stats = SearchStatistics()
         self.blast = None
+        # Number of workers asked to exit by the worker scaler
+        self.retire_workers = mp.Value('i', 0)
         # TODO change to something session-dependent
         self.context = None
 
@@ -58,28 +64,57 @@ class Search(RPCHandlers):
 
     log_rpcs = True
 
-    def __init__(self, config, blast_conn):
+    def __init__(self, config, blast_conn, state=None):
         RPCHandlers.__init__(self)
         self._server_id = config.serverids[0]  # Canonical server ID
         self._blast_conn = blast_conn
-        self._state = SearchState(config)
+        if state is None:
+            state = SearchState(config)
+        self._state = state
         self._filters = FilterStack()
         self._running = False
         self._scope = None
         self._workers = None
+        # Warm runner for reexecute_filters, and threads with warm runners
+        # for reexecute_filters_batch
+        self._reexec_runner = None
+        self._reexec_threads = []
+        # (Object, output attrs) waiting for a reexecution thread
+        self._reexec_queue = Queue()
+        # Finished XDR_reexecute_results not yet returned, and the number
+        # of batch objects not yet returned
+        self._reexec_results = Queue()
+        self._reexec_outstanding = 0
+        self._reexec_lock = threading.Lock()
 
     def shutdown(self):
         '''Clean up the search before the process exits.'''
 
+        # Return pooled filters used for reexecution
+        runners = [t.runner for t in self._reexec_threads]
+        if self._reexec_runner is not None:
+            runners.append(self._reexec_runner)
+        for runner in runners:
+            runner.release()
+
         # Clean up the resource context before terminate() to avoid corrupting the shared data structures.
         self._state.context.cleanup()
 
+        workers = []
         while self._workers:
             p = self._workers.pop()
             _log.debug("Terminating worker process %d", p.pid)
             try:
                 p.terminate()   # send SIGTERM, which will be caught as _Signalled in the child
-                p.join(1)   # allow it to clean up
+                workers.append(p)
+            except OSError: # perhaps process already dead
+                pass
+        # allow them to clean up, including flushing their result cache
+        # updates
+        deadline = time.time() + CACHE_FLUSH_TIMEOUT + 1
+        for p in workers:
+            try:
+                p.join(max(deadline - time.time(), 0))
                 os.kill(p.pid, signal.SIGKILL)  # shoot it in the head
                 p.join()
             except OSError: # perhaps process already dead
@@ -200,17 +235,26 @@ class Search(RPCHandlers):
 
         # Commit
         self._scope = scope
+        if filterstack is not self._filters:
+            # Warm runners are bound to the old filters
+            self._reset_reexecution()
         self._filters = filterstack
         return protocol.XDR_blob_list(missing)
 
-    @RPCHandlers.handler(26, protocol.XDR_blob_data)
+    @RPCHandlers.handler(26, protocol.XDR_blob_data, streaming=True)
     @running(False)
-    def send_blobs(self, params):
-        '''Add blobs to the blob cache.'''
-        _log.info('Received %d blobs, %d bytes', len(params.blobs),
-                  sum([len(b) for b in params.blobs]))
-        for blob in params.blobs:
-            self._state.blob_cache.add(blob)
+    def send_blobs(self, body):
+        '''Add blobs to the blob cache, writing each to disk as it
+        arrives.'''
+        count = body.read_uint()
+        size = 0
+        for _i in range(count):
+            with self._state.blob_cache.add_stream() as writer:
+                for chunk in body.read_opaque():
+                    writer.write(chunk)
+                writer.commit()
+            size += writer.size
+        _log.info('Received %d blobs, %d bytes', count, size)
 
     @RPCHandlers.handler(28, protocol.XDR_start)
     @running(False)
@@ -243,42 +287,123 @@ class Search(RPCHandlers):
         workers = self._filters.start_threads(self._state, self._state.config.threads, self._scope)
         self._workers = workers
 
-    @RPCHandlers.handler(30, protocol.XDR_reexecute,
-                         protocol.XDR_attribute_list)
-    def reexecute_filters(self, params):
-        '''Reexecute the search on the specified object.'''
+    def _prepare_reexecution(self, context_id, attrs):
+        '''Validate and optimize the filter stack for reexecution, and
+        return the set of attributes to return, or None for all.'''
         try:
             self._check_runnable()
         except RPCError as e:
             _log.warning('Cannot reexecute filters: %s', str(e))
             raise
-        _log.info('Reexecuting on object %s', params.object_id)
 
-        if params.attrs is not None:
-            output_attrs = set(params.attrs)
+        if attrs is not None:
+            output_attrs = set(attrs)
         else:
             # If no output attributes were specified, encode everything
             output_attrs = None
 
-        _log.info('Push attributes: {}'.format(','.join(params.attrs or ['(everything)'] )))
+        _log.info('Push attributes: {}'.format(','.join(attrs or ['(everything)'] )))
 
         self._filters.optimize()
         _log.info("Optimized filter stack [%d]: %s" % (len(self._filters),
                                                        ','.join([f.name for f in self._filters])))
 
         if not self._state.context:
-            self._state.context = ResourceContext(params.object_id, self._state.config, lock=threading.Lock(), catalog=dict())
+            self._state.context = ResourceContext(context_id, self._state.config, lock=threading.Lock(), catalog=dict())
+        return output_attrs
+
+    def _reset_reexecution(self):
+        '''Stop the reexecution threads, release the warm runners, and
+        discard pending reexecution results.'''
+        # Pending objects would be evaluated with the old filters
+        while True:
+            try:
+                self._reexec_queue.get_nowait()
+            except Empty:
+                break
+        for _thread in self._reexec_threads:
+            self._reexec_queue.put(None)
+        for thread in self._reexec_threads:
+            thread.join()
+            thread.runner.release()
+        self._reexec_threads = []
+        if self._reexec_runner is not None:
+            self._reexec_runner.release()
+            self._reexec_runner = None
+        self._reexec_queue = Queue()
+        self._reexec_results = Queue()
+        with self._reexec_lock:
+            self._reexec_outstanding = 0
+
+    @RPCHandlers.handler(30, protocol.XDR_reexecute,
+                         protocol.XDR_attribute_list)
+    def reexecute_filters(self, params):
+        '''Reexecute the search on the specified object.'''
+        _log.info('Reexecuting on object %s', params.object_id)
+        output_attrs = self._prepare_reexecution(params.object_id,
+                                                 params.attrs)
 
-        runner = self._filters.bind(self._state, None)  # no need for queue as we'll call evaluate(obj) directly, not run()
         obj = Object(self._server_id, params.object_id)
         loader = ObjectLoader(self._state.config, self._state.blob_cache)
         if not loader.source_available(obj):
             raise DiamondRPCFCacheMiss()
-        drop = not runner.evaluate(obj)
+        # Keep the runner, and its filters, warm for later reexecutions
+        if self._reexec_runner is None:
+            self._reexec_runner = self._filters.bind(self._state, None)  # no need for queue as we'll call evaluate(obj) directly, not run()
+        drop = not self._reexec_runner.evaluate(obj)
 
         return protocol.XDR_attribute_list(
             obj.xdr_attributes(output_attrs, for_drop=drop))
 
+    @RPCHandlers.handler(32, protocol.XDR_reexecute_batch)
+    def reexecute_filters_batch(self, params):
+        '''Start reexecuting the search on the specified objects, in
+        parallel.  Results are retrieved with reexecute_results.'''
+        _log.info('Reexecuting on %d objects', len(params.object_ids))
+        if not params.object_ids:
+            return
+        output_attrs = self._prepare_reexecution(params.object_ids[0],
+                                                 params.attrs)
+
+        loader = ObjectLoader(self._state.config, self._state.blob_cache)
+        with self._reexec_lock:
+            self._reexec_outstanding += len(params.object_ids)
+        for object_id in params.object_ids:
+            obj = Object(self._server_id, object_id)
+            if loader.source_available(obj):
+                self._reexec_queue.put((obj, output_attrs))
+            else:
+                self._reexec_results.put(protocol.XDR_reexecute_result(
+                    object_id=object_id, status=DiamondRPCFCacheMiss.code,
+                    attrs=[]))
+
+        # Start threads with warm runners, up to one per configured worker
+        threads = self._state.config.threads
+        wanted = min(threads, self._reexec_queue.qsize())
+        while len(self._reexec_threads) < wanted:
+            thread = _ReexecutionThread(
+                self._filters.bind(self._state, None), self._reexec_queue,
+                self._reexec_results, threads)
+            thread.start()
+            self._reexec_threads.append(thread)
+
+    @RPCHandlers.handler(33, reply_class=protocol.XDR_reexecute_results)
+    def reexecute_results(self):
+        '''Wait for results from reexecute_filters_batch and return those
+        that are ready.  Returns no results if none are outstanding.'''
+        with self._reexec_lock:
+            if not self._reexec_outstanding:
+                return protocol.XDR_reexecute_results(results=[])
+        results = [self._reexec_results.get()]
+        while True:
+            try:
+                results.append(self._reexec_results.get_nowait())
+            except Empty:
+                break
+        with self._reexec_lock:
+            self._reexec_outstanding -= len(results)
+        return protocol.XDR_reexecute_results(results=results)
+
     @RPCHandlers.handler(29, reply_class=protocol.XDR_search_stats)
     @running(True)
     def request_stats(self):
@@ -306,6 +431,33 @@ class Search(RPCHandlers):
         self._state.session_vars.client_set(values)
 
 
+class _ReexecutionThread(threading.Thread):
+    '''Thread reexecuting queued objects with its own warm
+    FilterStackRunner.'''
+
+    def __init__(self, runner, objects, results, workers):
+        threading.Thread.__init__(self, name='reexecute-thread')
+        self.daemon = True
+        self.runner = runner
+        self._objects = objects
+        self._results = results
+        self._workers = workers
+
+    def run(self):
+        self.runner.evaluate_queue(self._objects, self._report,
+                                   self._workers)
+
+    def _report(self, obj, output_attrs, accept):
+        if accept is None:
+            result = protocol.XDR_reexecute_result(
+                object_id=str(obj), status=DiamondRPCFailure.code, attrs=[])
+        else:
+            result = protocol.XDR_reexecute_result(
+                object_id=str(obj), status=0,
+                attrs=obj.xdr_attributes(output_attrs, for_drop=not accept))
+        self._results.put(result)
+
+
 class _BlastChannelSender(RPCHandlers):
     '''Single-use RPC handler for sending an XDR_object on the blast
     channel.'''
@@ -333,11 +485,11 @@ class BlastChannel(object):
 
     def __init__(self, conn, push_attrs):
         self._conn = conn
-        self._push_attrs = push_attrs
+        self._projection = push_projection(push_attrs)
 
     def send(self, obj):
         '''Send the specified Object on the blast channel.'''
-        xdr = obj.xdr(self._push_attrs)
+        xdr = obj.xdr(self._projection)
         _BlastChannelSender(xdr).send(self._conn)
 
     def close(self):
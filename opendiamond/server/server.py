@@ -23,7 +23,8 @@ is performed non-blockingly.  It is responsible for the following:
 them via a nonce communicated when the connection is first established.
 
 2.  Establishing a temporary directory and forking a child process for every
-connection pair.
+connection pair.  A few spare children are forked and initialized ahead of
+time, and accepted connection pairs are handed to them when available.
 
 3.  Cleaning up after search processes which have exited by deleting their
 temporary directories and killing all of their children (filters and helper
@@ -48,13 +49,20 @@ which is used for result and attribute caching.  Each worker thread also
 maintains one child process for each filter in the filter stack.  These
 children are the actual filter code, and communicate with the worker thread
 via a pair of pipes.  Because each worker thread has its own set of filter
-processes, worker threads can process objects independently.
+processes, worker threads can process objects independently.  If
+FILTERPOOLIDLE is set, filter processes are leased from a pool process
+forked by the supervisor, so that later searches with identically
+configured filters can reuse them without reinitializing them.
 
 Each worker thread executes a loop:
 
-1.  Obtain a new object from the ScopeListLoader.
+1.  Obtain a new object from the ScopeListLoader.  A prefetch thread in
+each worker pulls a few objects ahead and fetches their data from the
+dataretriever concurrently.
 
-2.  Retrieve result cache entries from Redis.
+2.  Retrieve result cache entries from the worker's in-memory LRU or, failing
+that, from Redis.  Entries for the next several queued objects are requested
+from Redis together.
 
 3.  Walk the result cache entries to determine if a drop decision can be
 made.  If so, drop the object.
@@ -63,10 +71,12 @@ made.  If so, drop the object.
 valid result cache entry for the filter.  If so, attempt to obtain attribute
 cache entries from Redis.  If successful, merge the cached attributes into
 the object.  Otherwise, execute the filter.  If the filter produces a drop
-decision, break.
+decision, break.  Every so often, the worker reorders independent filters
+so that cheap, selective filters run first.
 
 5.  Transmit new result cache entries, as well as attribute cache entries
-for filters producing less than 2 MB/s of attribute values, to Redis.
+for filters producing less than 2 MB/s of attribute values, to Redis.  A
+background thread writes these in batches.
 
 6.  If accepting the object, transmit it to the client via the blast
 channel.
@@ -93,8 +103,9 @@ from opendiamond.blobcache import ExecutableBlobCache
 from opendiamond.helpers import daemonize, signalname
 from opendiamond.rpc import RPCConnection, ConnectionFailure
 from opendiamond.server.child import ChildManager
+from opendiamond.server.filterpool import FilterPool
 from opendiamond.server.listen import ConnListener
-from opendiamond.server.search import Search
+from opendiamond.server.search import Search, SearchState
 
 SEARCH_LOG_DATE_FORMAT = '%Y-%m-%d-%H:%M:%S'
 SEARCH_LOG_FORMAT = 'search-%s-%d.log'          # Args: date, pid
@@ -137,8 +148,14 @@ class DiamondServer(object):
             daemonize()
 
         self.config = config
-        self._children = ChildManager(config.cgroupdir, not config.oneshot)
+        self._children = ChildManager(config.cgroupdir, not config.oneshot,
+                                      config.search_spares)
         self._listener = ConnListener(config.diamondd_port)
+        # SearchState created by a spare child before its connection
+        self._search_state = None
+        self._filter_pool = None
+        if config.filter_pool_idle > 0:
+            self._filter_pool = FilterPool(config)
         self._last_log_prune = datetime.fromtimestamp(0)
         self._last_cache_prune = datetime.fromtimestamp(0)
         self._ignore_signals = False
@@ -172,16 +189,21 @@ class DiamondServer(object):
             _log.info('Server IDs: %s', ', '.join(self.config.serverids))
             if self.config.cache_server:
                 _log.info('Cache: %s:%d', *self.config.cache_server)
+            if self._filter_pool is not None:
+                self._filter_pool.start()
             while True:
+                # Replace spare children used by the last connection
+                self._children.prefork(self._child_init, self._child)
                 # Check for search logs that need to be pruned
                 self._prune_child_logs()
                 # Check for blob cache objects that need to be pruned
                 self._prune_blob_cache()
                 # Accept a new connection pair
                 control, data = self._listener.accept()
-                # Fork a child for this connection pair.  In the child, this
-                # does not return.
-                self._children.start(self._child, control, data)
+                # Hand the connection pair to a spare child, or fork a
+                # child for it.  In the child, this does not return.
+                if not self._children.handoff(control, data):
+                    self._children.start(self._child, control, data)
                 # Close the connection pair in the parent
                 control.close()
                 data.close()
@@ -191,6 +213,8 @@ class DiamondServer(object):
             self._listener.shutdown()
             # Kill our children and clean up after them
             self._children.kill_all()
+            if self._filter_pool is not None:
+                self._filter_pool.shutdown()
             # Shut down logging
             logging.shutdown()
             # Ensure our exit status reflects that we died on the signal
@@ -203,32 +227,40 @@ class DiamondServer(object):
             sys.exit(1)
     # pylint: enable=broad-except,unpacking-non-sequence
 
+    def _child_init(self):
+        '''Set up a child process before it has a connection pair.'''
+        # Close supervisor log; the search log is opened when the search
+        # starts, so that its name has the right timestamp
+        logging.getLogger().removeHandler(self._logfile_handler)
+        del self._logfile_handler
+
+        if self.config.sentry_dsn:
+            sentry_handler = SentryHandler(self.config.sentry_dsn)
+            sentry_handler.setLevel(logging.ERROR)
+            setup_logging(sentry_handler)
+
+        # Close listening socket and half-open connections
+        self._listener.shutdown()
+        self._search_state = SearchState(self.config)
+
     # We intentionally catch all exceptions
     # pylint: disable=broad-except
     def _child(self, control, data):
         '''Main function for child process.'''
-        # Close supervisor log, open child log
-        baselog = logging.getLogger()
-        baselog.removeHandler(self._logfile_handler)
-        del self._logfile_handler
+        if self._search_state is None:
+            self._child_init()
+        # Open child log
         now = datetime.now().strftime(SEARCH_LOG_DATE_FORMAT)
         logname = SEARCH_LOG_FORMAT % (now, os.getpid())
         logpath = os.path.join(self.config.logdir, logname)
         handler = logging.FileHandler(logpath)
         handler.setFormatter(_TimestampedLogFormatter())
-        baselog.addHandler(handler)
-
-        if self.config.sentry_dsn:
-            sentry_handler = SentryHandler(self.config.sentry_dsn)
-            sentry_handler.setLevel(logging.ERROR)
-            setup_logging(sentry_handler)
+        logging.getLogger().addHandler(handler)
 
         # Okay, now we have logging
         search = None
         try:
             try:
-                # Close listening socket and half-open connections
-                self._listener.shutdown()
                 # Log startup of child
                 _log.info('Starting search %s, pid %d',
                           opendiamond.__version__, os.getpid())
@@ -236,7 +268,8 @@ class DiamondServer(object):
                 _log.info('Worker threads: %d', self.config.threads)
                 # Set up connection wrappers and search object
                 control = RPCConnection(control)
-                search = Search(self.config, RPCConnection(data))
+                search = Search(self.config, RPCConnection(data),
+                                self._search_state)
                 # Dispatch RPCs on the control connection until we die
                 while True:
                     control.dispatch(search)
@@ -18,11 +18,21 @@ from past.utils import old_div
 from builtins import object
 import logging
 import multiprocessing as mp
+import os
 import threading
 import time
 
 from opendiamond.protocol import XDR_search_stats, XDR_filter_stats, XDR_stat
 
+# Counter shards per statistics object, each written by one process;
+# later processes share an extra shard under a lock
+STATS_SHARDS = 128
+# Latency histogram buckets: four per power of two microseconds, up to
+# about 2^40 us
+HISTOGRAM_BUCKETS = 160
+# Percentiles reported for each histogram
+HISTOGRAM_PERCENTILES = (50, 90, 99)
+
 _log = logging.getLogger(__name__)
 
 
@@ -48,9 +58,30 @@ class NoLogger(object):
     def on_terminate(self):
         pass
 
+    def on_timeout(self):
+        pass
+
+    def on_deadline_exceeded(self):
+        pass
+
     def on_unloadable(self):
         pass
 
+    def on_result_cache_lookup(self, hits, misses):
+        pass
+
+    def on_attribute_cache_lookup(self, hit):
+        pass
+
+    def on_attribute_cache_store(self, raw_bytes, stored_bytes):
+        pass
+
+    def on_attribute_cache_reject(self):
+        pass
+
+    def on_cache_write_failed(self):
+        pass
+
     def on_finish(self):
         pass
 
@@ -72,26 +103,33 @@ class FilterRunnerLogger(object):
         self.eval_timer.reset()
 
     def on_done_evaluate(self, accept, gt_present=False):
-        with self.stats.lock:
-            self.stats.execution_us += self.eval_timer.elapsed
-            self.stats.objs_processed += 1
-            self.stats.objs_computed += 1
-            self.stats.objs_dropped += int(not accept)
-            self.stats.objs_true_positive += int(accept and gt_present)
-            self.stats.objs_false_negative += int(not accept and gt_present)
+        elapsed = self.eval_timer.elapsed
+        self.stats.update(
+            execution_us=elapsed,
+            objs_processed=1,
+            objs_computed=1,
+            objs_dropped=int(not accept),
+            objs_true_positive=int(accept and gt_present),
+            objs_false_negative=int(not accept and gt_present))
+        self.stats.record('exec_time', elapsed)
 
     def on_cache_hit(self, accept, gt_present=False):
-        with self.stats.lock:
-            self.stats.objs_processed += 1
-            self.stats.objs_dropped += int(not accept)
-            self.stats.objs_cache_dropped += int(not accept)
-            self.stats.objs_cache_passed += int(accept)
-            self.stats.objs_true_positive += int(accept and gt_present)
-            self.stats.objs_false_negative += int(not accept and gt_present)
+        self.stats.update(
+            objs_processed=1,
+            objs_dropped=int(not accept),
+            objs_cache_dropped=int(not accept),
+            objs_cache_passed=int(accept),
+            objs_true_positive=int(accept and gt_present),
+            objs_false_negative=int(not accept and gt_present))
 
     def on_terminate(self):
-        with self.stats.lock:
-            self.stats.objs_terminate += 1
+        self.stats.update(objs_terminate=1)
+
+    def on_timeout(self):
+        self.stats.update(objs_timeout=1)
+
+    def on_deadline_exceeded(self):
+        self.stats.update(objs_over_budget=1)
 
 
 class FilterStackRunnerLogger(object):
@@ -108,13 +146,15 @@ class FilterStackRunnerLogger(object):
         self.eval_timer.reset()
 
     def on_done_evaluate(self, accept, gt_present=False):
-        with self.stats.lock:
-            self.stats.objs_processed += 1
-            self.stats.objs_passed += int(accept)
-            self.stats.objs_dropped += int(not accept)
-            self.stats.objs_true_positive += int(accept and gt_present)
-            self.stats.objs_false_negative += int(not accept and gt_present)
-            self.stats.execution_us += self.eval_timer.elapsed
+        elapsed = self.eval_timer.elapsed
+        self.stats.update(
+            objs_processed=1,
+            objs_passed=int(accept),
+            objs_dropped=int(not accept),
+            objs_true_positive=int(accept and gt_present),
+            objs_false_negative=int(not accept and gt_present),
+            execution_us=elapsed)
+        self.stats.record('obj_time', elapsed)
 
         # if self.objs_processed % 1000 == 0:
         #     _log.debug('Processed %d objects', self.objs_processed)
@@ -124,37 +164,175 @@ class FilterStackRunnerLogger(object):
         self.objs_dropped += int(not accept)
 
     def on_unloadable(self):
-        with self.stats.lock:
-            self.stats.objs_unloadable += 1
+        self.stats.update(objs_unloadable=1)
 
         self.objs_unloadable += 1
 
+    def on_result_cache_lookup(self, hits, misses):
+        self.stats.update(result_cache_hits=hits,
+                          result_cache_misses=misses)
+
+    def on_attribute_cache_lookup(self, hit):
+        self.stats.update(attr_cache_hits=int(hit),
+                          attr_cache_misses=int(not hit))
+
+    def on_attribute_cache_store(self, raw_bytes, stored_bytes):
+        self.stats.update(attr_cache_stores=1,
+                          attr_cache_raw_bytes=raw_bytes,
+                          attr_cache_stored_bytes=stored_bytes)
+
+    def on_attribute_cache_reject(self):
+        self.stats.update(attr_cache_rejects=1)
+
+    def on_cache_write_failed(self):
+        self.stats.update(cache_write_failures=1)
+
     def on_finish(self):
         _log.info(
             'Worker: objs processed/passed/dropped/unloadable: %d/%d/%d/%d',
             self.objs_processed, self.objs_passed, self.objs_dropped, self.objs_unloadable)
 
 
+class _ShardAllocator(object):
+    '''Assigns each process its own statistics shard.'''
+
+    def __init__(self):
+        # Shard 0 is shared by processes beyond STATS_SHARDS
+        self._next = mp.Value('i', 1)
+        # (pid, shard, lock serializing the process's threads); forked
+        # processes inherit their parent's and replace it on first use
+        self._owner = (None, 0, None)
+
+    def get(self):
+        '''Return the calling process's shard, or 0, and the lock its
+        threads hold while updating the shard.'''
+        pid = os.getpid()
+        owner = self._owner
+        if owner[0] != pid:
+            with self._next.get_lock():
+                owner = self._owner
+                if owner[0] != pid:
+                    shard = self._next.value
+                    self._next.value += 1
+                    owner = (pid, shard if shard < STATS_SHARDS else 0,
+                             threading.Lock())
+                    self._owner = owner
+        return owner[1], owner[2]
+
+
+# Created with the first statistics object in a search process, and
+# inherited by its workers
+_allocator = None
+
+
+def _bucket(us):
+    '''Return the histogram bucket for a latency.'''
+    if us < 4:
+        return max(us, 0)
+    exp = us.bit_length() - 1
+    return min((exp - 1) * 4 + ((us >> (exp - 2)) & 3),
+               HISTOGRAM_BUCKETS - 1)
+
+
+def _bucket_limit(bucket):
+    '''Return the smallest latency above the given bucket.'''
+    bucket += 1
+    if bucket < 4:
+        return bucket
+    return (4 + bucket % 4) << (bucket // 4 - 1)
+
+
 class _Statistics(object):
-    '''Base class for server statistics. Can be shared by multiple processes.'''
+    '''Base class for server statistics. Can be shared by multiple processes.
+
+    Counters are kept in a shared-memory array with a shard for each
+    updating process, and only summed when read, so that update() only
+    takes a lock private to the process.  Reads of single counters and
+    assignments should hold self.lock.'''
 
     label = 'Unconfigured statistics'
     attrs = ()
+    # (name, description) of latency histograms, in microseconds
+    histograms = ()
 
     def __init__(self):
+        global _allocator  # pylint: disable=global-statement
+        if _allocator is None:
+            _allocator = _ShardAllocator()
+        self._allocator = _allocator
         self.lock = mp.Lock()
-        self._stats = dict([(name, mp.Value('i', 0, lock=False)) for name, _desc in self.attrs])
+        self._overflow_lock = mp.Lock()
+        # counter or histogram name -> first slot in a shard
+        self._slots = dict((name, i)
+                           for i, (name, _desc) in enumerate(self.attrs))
+        for i, (name, _desc) in enumerate(self.histograms):
+            self._slots[name] = len(self.attrs) + i * HISTOGRAM_BUCKETS
+        # Round shards up to whole cache lines.  64-bit, since byte and
+        # microsecond counts overflow 32 bits.
+        slots = len(self.attrs) + len(self.histograms) * HISTOGRAM_BUCKETS
+        self._stride = (slots + 7) & ~7
+        self._counters = mp.RawArray('q', self._stride * STATS_SHARDS)
 
     def __getattr__(self, key):
-        return self._stats[key].value
+        if key.startswith('_') or key not in self._slots:
+            raise AttributeError(key)
+        return sum(self._counters[self._slots[key]::self._stride])
 
     def __setattr__(self, name, value):
         """Ugly hack to let updating statistics look intuitive at caller site"""
-        if name in ('_stats', 'lock') or name not in self._stats:
+        if name.startswith('_') or name == 'lock' or name not in self._slots:
             super(_Statistics, self).__setattr__(name, value)
         else:
-            self._stats[name].value = value
-        
+            self.update(**{name: value - getattr(self, name)})
+
+    def _add(self, slot_deltas):
+        shard, lock = self._allocator.get()
+        counters = self._counters
+        base = shard * self._stride
+        with lock if shard else self._overflow_lock:
+            for slot, delta in slot_deltas:
+                counters[base + slot] += delta
+
+    def update(self, **deltas):
+        '''Add the specified amounts to counters.'''
+        self._add([(self._slots[name], delta)
+                   for name, delta in deltas.items()])
+
+    def record(self, histogram, us):
+        '''Add a latency to a histogram.'''
+        self._add([(self._slots[histogram] + _bucket(us), 1)])
+
+    def percentiles(self, histogram):
+        '''Return the upper bounds, in us, of the buckets containing each
+        of HISTOGRAM_PERCENTILES, or zeroes if the histogram is empty.'''
+        counters, stride = self._counters, self._stride
+        base = self._slots[histogram]
+        counts = [sum(counters[base + b::stride])
+                  for b in range(HISTOGRAM_BUCKETS)]
+        total = sum(counts)
+        result = []
+        for pct in HISTOGRAM_PERCENTILES:
+            if not total:
+                result.append(0)
+                continue
+            want = old_div(total * pct + 99, 100)
+            seen = 0
+            for bucket, count in enumerate(counts):
+                seen += count
+                if seen >= want:
+                    result.append(_bucket_limit(bucket))
+                    break
+        return result
+
+    def _histogram_stats(self):
+        '''Return XDR_stats for the percentiles of each histogram.'''
+        stats = []
+        for name, _desc in self.histograms:
+            for pct, us in zip(HISTOGRAM_PERCENTILES,
+                               self.percentiles(name)):
+                stats.append(XDR_stat('%s_p%d_us' % (name, pct), us))
+        return stats
+
     def log(self):
         """Dump all statistics to the log."""
 
@@ -162,6 +340,10 @@ class _Statistics(object):
         with self.lock:
             for name, desc in self.attrs:
                 _log.info('  %s: %d', desc, getattr(self, name))
+            for name, desc in self.histograms:
+                _log.info('  %s percentiles (us): %s', desc, ', '.join(
+                    'p%d %d' % item for item in
+                    zip(HISTOGRAM_PERCENTILES, self.percentiles(name))))
 
 
 class SearchStatistics(_Statistics):
@@ -172,7 +354,19 @@ class SearchStatistics(_Statistics):
              ('objs_true_positive', 'Objects passed with label'),
              ('objs_false_negative', 'Objects dropped with label'),
              ('objs_unloadable', 'Objects failing to load'),
-             ('execution_us', 'Total object examination time (us)'))
+             ('execution_us', 'Total object examination time (us)'),
+             ('result_cache_hits', 'Result cache hits'),
+             ('result_cache_misses', 'Result cache misses'),
+             ('attr_cache_hits', 'Attribute cache hits'),
+             ('attr_cache_misses', 'Attribute cache misses'),
+             ('attr_cache_stores', 'Attribute cache stores'),
+             ('attr_cache_rejects', 'Attribute cache stores declined'),
+             ('attr_cache_raw_bytes', 'Attribute cache bytes before compression'),
+             ('attr_cache_stored_bytes', 'Attribute cache bytes stored'),
+             ('cache_write_failures', 'Failed cache updates'),
+             ('workers_started', 'Worker processes started'),
+             ('workers_retired', 'Worker processes retired'))
+    histograms = (('obj_time', 'Object examination time'),)
 
     def __init__(self):
         super(SearchStatistics, self).__init__()
@@ -188,9 +382,16 @@ class SearchStatistics(_Statistics):
             stats = []
             stats.append(XDR_stat('objs_total', objs_total))
             stats.append(XDR_stat('avg_obj_time_us', avg_obj_us))
+            for prefix in 'result_cache', 'attr_cache':
+                hits = getattr(self, prefix + '_hits')
+                lookups = hits + getattr(self, prefix + '_misses')
+                if lookups:
+                    stats.append(XDR_stat(prefix + '_hit_pct',
+                                          old_div(100 * hits, lookups)))
             for name, _desc in self.attrs:
                 if name != 'execution_us':
                     stats.append(XDR_stat(name, getattr(self, name)))
+            stats.extend(self._histogram_stats())
 
             return XDR_search_stats(
                 stats=stats,
@@ -209,8 +410,11 @@ class FilterStatistics(_Statistics):
              ('objs_cache_passed', 'Objects skipped by cache'),
              ('objs_computed', 'Objects examined by filter'),
              ('objs_terminate', 'Objects causing filter to terminate'),
+             ('objs_over_budget', 'Objects exceeding filter time budget'),
+             ('objs_timeout', 'Objects causing filter to be killed'),
              ('execution_us', 'Filter execution time (us)'),
              )
+    histograms = (('exec_time', 'Filter execution time'),)
 
     def __init__(self, name):
         super(FilterStatistics, self).__init__()
@@ -230,6 +434,7 @@ class FilterStatistics(_Statistics):
             for name, _desc in self.attrs:
                 if name != 'execution_us':
                     stats.append(XDR_stat(name, getattr(self, name)))
+            stats.extend(self._histogram_stats())
 
             return XDR_filter_stats(
                 name=self.name,
@@ -230,6 +230,11 @@ class XDRStruct(object):
             self.encode_xdr(xdr)
             return xdr.get_buffer()
 
+    def encode_segments(self):
+        '''Return the serialized object as a list of buffers, to be sent
+        with scatter-gather I/O.'''
+        return [self.encode()]
+
     @classmethod
     def decode(cls, data):
         '''Deserialize the data and return an object.'''
@@ -59,7 +59,19 @@ setup(
     long_description=LONG_DESCRIPTION,
     long_description_content_type='text/markdown',
     packages=PACKAGES,
-    ext_modules=[],
+    # The extensions accelerate pure-Python code, so a failed build
+    # falls back to it rather than failing the install
+    ext_modules=[
+        Extension('opendiamond._murmur',
+                  [os.path.join(SRC_PATH, 'opendiamond', '_murmur.c')],
+                  optional=True),
+        Extension('opendiamond._xdr',
+                  [os.path.join(SRC_PATH, 'opendiamond', '_xdr.c')],
+                  optional=True),
+        Extension('opendiamond._scopelist',
+                  [os.path.join(SRC_PATH, 'opendiamond', '_scopelist.c')],
+                  optional=True),
+    ],
     zip_safe=False,
     install_requires=REQUIRES,
     extras_require={
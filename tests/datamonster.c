@@ -16,6 +16,8 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -24,10 +26,21 @@
 #include <glib.h>
 #include <glib/gstdio.h>
 
+#ifdef HAVE_LINUX_FIEMAP_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
 static gboolean presort;
 static gboolean sort;
+static gboolean fiemap;
 static gboolean decompress;
+static gint nthreads;
+static gint ndecoders;
+static gint scale = 1;
 static gchar *dataroot;
+static gchar *outfile;
 static gchar **idxfiles;
 
 static GOptionEntry options[] = {
@@ -35,9 +48,21 @@ static GOptionEntry options[] = {
 	"Sort index files by name", NULL },
     { "sort", 's', 0, G_OPTION_ARG_NONE, &sort,
 	"Sort index files by inode", NULL },
+#ifdef HAVE_LINUX_FIEMAP_H
+    { "fiemap", 'f', 0, G_OPTION_ARG_NONE, &fiemap,
+	"Sort index files by physical location of first extent", NULL },
+#endif
+    { "threads", 't', 0, G_OPTION_ARG_INT, &nthreads,
+	"Threads used to collect sort keys (default: # of CPUs)", "N" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &outfile,
+	"Write the reordered index to OUTFILE", "OUTFILE" },
 #ifdef HAVE_JPEGLIB_H
     { "jpeg", 'j', 0, G_OPTION_ARG_NONE, &decompress,
 	"Decompress jpeg files", NULL },
+    { "decoders", 'D', 0, G_OPTION_ARG_INT, &ndecoders,
+	"Threads decompressing jpeg files (default: # of CPUs)", "N" },
+    { "scale", 'S', 0, G_OPTION_ARG_INT, &scale,
+	"Decompress jpeg files at 1/DENOM scale (1, 2, 4 or 8)", "DENOM" },
 #endif
     { "dataroot", 'd', 0, G_OPTION_ARG_FILENAME, &dataroot,
 	"Directory containing files", "DATAROOT" },
@@ -49,6 +74,7 @@ static GOptionEntry options[] = {
 struct elem {
     gchar *file;
     ino_t ino;
+    guint64 physical;
 };
 
 static int cmp_by_name(gconstpointer a, gconstpointer b)
@@ -67,6 +93,17 @@ static int cmp_by_ino(gconstpointer a, gconstpointer b)
     return 1;
 }
 
+static int cmp_by_physical(gconstpointer a, gconstpointer b)
+{
+    const struct elem *ea = a;
+    const struct elem *eb = b;
+    if (ea->physical < eb->physical) return -1;
+    if (ea->physical > eb->physical) return 1;
+    /* files without a mapped extent all sort to the front; keep them
+     * in inode order */
+    return cmp_by_ino(a, b);
+}
+
 static GArray *read_index(const gchar *idxfile)
 {
     gchar *gididx, **files;
@@ -97,22 +134,125 @@ static GArray *read_index(const gchar *idxfile)
     return array;
 }
 
-static void collect_inos(GArray *array)
+#ifdef HAVE_LINUX_FIEMAP_H
+/* returns the physical byte offset of the first extent of the file, or 0
+ * if the file has no mapped extents or the filesystem lacks FIEMAP */
+static guint64 first_extent(int fd, struct fiemap *fm)
+{
+    memset(fm, 0, sizeof(struct fiemap) + sizeof(struct fiemap_extent));
+    fm->fm_start = 0;
+    fm->fm_length = FIEMAP_MAX_OFFSET;
+    fm->fm_extent_count = 1;
+
+    if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0 || fm->fm_mapped_extents == 0)
+	return 0;
+    return fm->fm_extents[0].fe_physical;
+}
+#endif
+
+struct collector {
+    GArray *array;
+    unsigned int first;
+    unsigned int stride;
+};
+
+static gpointer collect_thread(gpointer data)
 {
+    struct collector *c = data;
     struct elem *elem;
     struct stat buf;
     unsigned int i;
+#ifdef HAVE_LINUX_FIEMAP_H
+    struct fiemap *fm = NULL;
+    int fd;
 
-    for (i = 0; i < array->len; i++)
-    {
-	elem = &g_array_index(array, struct elem, i);
+    if (fiemap)
+	fm = g_malloc(sizeof(struct fiemap) + sizeof(struct fiemap_extent));
+#endif
 
+    for (i = c->first; i < c->array->len; i += c->stride)
+    {
+	elem = &g_array_index(c->array, struct elem, i);
+
+#ifdef HAVE_LINUX_FIEMAP_H
+	if (fiemap) {
+	    fd = g_open(elem->file, O_RDONLY, 0);
+	    if (fd == -1 || fstat(fd, &buf)) {
+		fprintf(stderr, "Failed to open \"%s\"\n", elem->file);
+		if (fd != -1) close(fd);
+		continue;
+	    }
+	    elem->ino = buf.st_ino;
+	    elem->physical = first_extent(fd, fm);
+	    close(fd);
+	    continue;
+	}
+#endif
 	if (g_stat(elem->file, &buf)) {
 	    fprintf(stderr, "Failed to stat \"%s\"\n", elem->file);
 	    continue;
 	}
 	elem->ino = buf.st_ino;
     }
+#ifdef HAVE_LINUX_FIEMAP_H
+    g_free(fm);
+#endif
+    return NULL;
+}
+
+/* fills in the inode numbers and, when sorting by extent, the physical
+ * location of every file in the index, striping the files over nthreads
+ * threads to keep enough requests in flight to saturate the disks */
+static void collect_sort_keys(GArray *array)
+{
+    struct collector *collectors;
+    GThread **threads;
+    int i;
+
+    collectors = g_new(struct collector, nthreads);
+    threads = g_new0(GThread *, nthreads);
+
+    for (i = 0; i < nthreads; i++) {
+	collectors[i].array = array;
+	collectors[i].first = i;
+	collectors[i].stride = nthreads;
+	threads[i] = g_thread_create(collect_thread, &collectors[i],
+				     TRUE, NULL);
+	if (threads[i] == NULL) {
+	    /* no more threads, pick up the remaining stripes here */
+	    for (; i < nthreads; i++) {
+		collectors[i].array = array;
+		collectors[i].first = i;
+		collectors[i].stride = nthreads;
+		collect_thread(&collectors[i]);
+	    }
+	    break;
+	}
+    }
+    for (i = 0; i < nthreads; i++)
+	if (threads[i])
+	    g_thread_join(threads[i]);
+
+    g_free(threads);
+    g_free(collectors);
+}
+
+static void write_index(const gchar *path, GArray *array)
+{
+    GString *out;
+    GError *err = NULL;
+    unsigned int i;
+
+    out = g_string_sized_new(array->len * 32);
+    for (i = 0; i < array->len; i++) {
+	g_string_append(out, g_array_index(array, struct elem, i).file);
+	g_string_append_c(out, '\n');
+    }
+    if (!g_file_set_contents(path, out->str, out->len, &err)) {
+	fprintf(stderr, "%s\n", err->message);
+	g_error_free(err);
+    }
+    g_string_free(out, TRUE);
 }
 
 #ifdef HAVE_JPEGLIB_H
@@ -139,15 +279,20 @@ static void term_source(j_decompress_ptr cinfo)
 {
 }
 
-static void decompress_jpeg(const gchar *buf, gsize len)
+/* number of scanlines requested from the decompressor per call */
+#define DECODE_LINES 16
+
+/* returns the number of pixels decoded */
+static guint64 decompress_jpeg(const gchar *buf, gsize len)
 {
     struct jpeg_decompress_struct cinfo;
     struct jpeg_error_mgr jerr;
     struct jpeg_source_mgr source;
-    JSAMPROW line;
+    JSAMPARRAY lines;
+    guint64 npixels;
 
     if (len < 2 || buf[0] != (gchar)0xff || buf[1] != (gchar)0xd8)
-	return;
+	return 0;
 
     cinfo.err = jpeg_std_error(&jerr);
     jpeg_create_decompress(&cinfo);
@@ -161,24 +306,111 @@ static void decompress_jpeg(const gchar *buf, gsize len)
     cinfo.src->term_source = term_source;
 
     jpeg_read_header(&cinfo, TRUE);
+
+    /* let the IDCT do the downscaling */
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale;
+
     jpeg_start_decompress(&cinfo);
 
-    line = g_new(JSAMPLE, cinfo.output_width * cinfo.output_components);
+    lines = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE,
+		cinfo.output_width * cinfo.output_components, DECODE_LINES);
 
     while(cinfo.output_scanline < cinfo.output_height)
-	jpeg_read_scanlines(&cinfo, &line, 1);
+	jpeg_read_scanlines(&cinfo, lines, DECODE_LINES);
 
-    g_free(line);
+    npixels = (guint64)cinfo.output_width * cinfo.output_height;
 
     jpeg_finish_decompress(&cinfo);
     jpeg_destroy_decompress(&cinfo);
+    return npixels;
 }
 #else
-static void decompress_jpeg(const gchar *buf, gsize len)
+static guint64 decompress_jpeg(const gchar *buf, gsize len)
 {
+    return 0;
 }
 #endif
 
+/* buffers queued per decoder before the reader blocks */
+#define DECODE_BACKLOG 4
+
+struct decode_job {
+    gchar *buf;
+    gsize len;
+};
+
+struct decoder {
+    GThread *thread;
+    gdouble busy;
+    unsigned int nobjs;
+    guint64 nbytes;
+    guint64 npixels;
+};
+
+/* jobs flow from the reader to the decoders through decode_queue, and
+ * decode_slots holds one token for every job the reader may still queue,
+ * so memory use stays bounded when decoding can't keep up */
+static GAsyncQueue *decode_queue;
+static GAsyncQueue *decode_slots;
+static struct decode_job end_of_input;
+
+static gpointer decode_thread(gpointer data)
+{
+    struct decoder *d = data;
+    struct decode_job *job;
+    GTimer *timer = g_timer_new();
+
+    while ((job = g_async_queue_pop(decode_queue)) != &end_of_input) {
+	g_timer_start(timer);
+	d->npixels += decompress_jpeg(job->buf, job->len);
+	d->busy += g_timer_elapsed(timer, NULL);
+	d->nobjs++;
+	d->nbytes += job->len;
+
+	g_free(job->buf);
+	g_free(job);
+	g_async_queue_push(decode_slots, GINT_TO_POINTER(1));
+    }
+    g_timer_destroy(timer);
+    return NULL;
+}
+
+static struct decoder *start_decoders(void)
+{
+    struct decoder *decoders;
+    int i;
+
+    decode_queue = g_async_queue_new();
+    decode_slots = g_async_queue_new();
+    for (i = 0; i < ndecoders * DECODE_BACKLOG; i++)
+	g_async_queue_push(decode_slots, GINT_TO_POINTER(1));
+
+    decoders = g_new0(struct decoder, ndecoders);
+    for (i = 0; i < ndecoders; i++) {
+	decoders[i].thread = g_thread_create(decode_thread, &decoders[i],
+					     TRUE, NULL);
+	if (decoders[i].thread == NULL) {
+	    fprintf(stderr, "Can't create decoder thread\n");
+	    exit(1);
+	}
+    }
+    return decoders;
+}
+
+static void stop_decoders(struct decoder *decoders)
+{
+    int i;
+
+    for (i = 0; i < ndecoders; i++)
+	g_async_queue_push(decode_queue, &end_of_input);
+    for (i = 0; i < ndecoders; i++)
+	g_thread_join(decoders[i].thread);
+
+    g_async_queue_unref(decode_queue);
+    g_async_queue_unref(decode_slots);
+}
+
 int main(int argc, char **argv)
 {
     GOptionContext *context;
@@ -186,10 +418,12 @@ int main(int argc, char **argv)
     GArray *files;
     gchar *buf;
     gsize len;
-    unsigned int i;
+    unsigned int i, nobjs = 0;
     uint64_t nbytes = 0;
-    GTimer *timer;
-    gdouble elapsed;
+    GTimer *timer, *read_timer;
+    gdouble elapsed, read_busy = 0, stalled = 0;
+    struct decoder *decoders = NULL;
+    struct decode_job *job;
 
     context = g_option_context_new("- read lots of data");
     g_option_context_add_main_entries(context, options, NULL);
@@ -206,6 +440,26 @@ int main(int argc, char **argv)
 	exit(0);
     }
 
+    if (nthreads <= 0)
+	nthreads = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    if (ndecoders <= 0)
+	ndecoders = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+	fprintf(stderr, "Scale must be 1, 2, 4 or 8\n");
+	exit(0);
+    }
+
+    /* the output path is relative to where we were started, not dataroot */
+    if (outfile && !g_path_is_absolute(outfile)) {
+	gchar *cwd = g_get_current_dir();
+	gchar *path = g_build_filename(cwd, outfile, NULL);
+	g_free(cwd);
+	g_free(outfile);
+	outfile = path;
+    }
+
+    if (!g_thread_supported()) g_thread_init(NULL);
+
     timer = g_timer_new();
     files = read_index(idxfiles[0]);
     printf("Read index at %.3f sec\n", g_timer_elapsed(timer, NULL));
@@ -217,8 +471,15 @@ int main(int argc, char **argv)
 
     g_chdir(dataroot);
 
-    if (sort) {
-	collect_inos(files);
+    if (fiemap) {
+	collect_sort_keys(files);
+	printf("Collected extent locations at %.3f sec\n",
+	       g_timer_elapsed(timer, NULL));
+
+	g_array_sort(files, cmp_by_physical);
+	printf("Sorted index at %.3f sec\n", g_timer_elapsed(timer, NULL));
+    } else if (sort) {
+	collect_sort_keys(files);
 	printf("Collected inode numbers at %.3f sec\n",
 	       g_timer_elapsed(timer, NULL));
 
@@ -226,29 +487,86 @@ int main(int argc, char **argv)
 	printf("Sorted index at %.3f sec\n", g_timer_elapsed(timer, NULL));
     }
 
+    if (outfile) {
+	write_index(outfile, files);
+	printf("Wrote index to %s at %.3f sec\n", outfile,
+	       g_timer_elapsed(timer, NULL));
+    }
+
     fflush(stdout);
 
+    read_timer = g_timer_new();
     g_timer_start(timer);
+    if (decompress)
+	decoders = start_decoders();
+
     for (i = 0; i < files->len; i++) {
-	g_file_get_contents(g_array_index(files, struct elem, i).file,
-			    &buf, &len, NULL);
-	if (decompress) 
-	    decompress_jpeg(buf, len);
+	if (decompress) {
+	    g_timer_start(read_timer);
+	    g_async_queue_pop(decode_slots);
+	    stalled += g_timer_elapsed(read_timer, NULL);
+	}
+
+	g_timer_start(read_timer);
+	if (!g_file_get_contents(g_array_index(files, struct elem, i).file,
+				 &buf, &len, NULL))
+	    len = 0, buf = NULL;
+	read_busy += g_timer_elapsed(read_timer, NULL);
 
-	g_free(buf);
+	if (buf == NULL) {
+	    if (decompress)
+		g_async_queue_push(decode_slots, GINT_TO_POINTER(1));
+	    continue;
+	}
+	nobjs++;
 	nbytes += len;
+
+	if (decompress) {
+	    job = g_new(struct decode_job, 1);
+	    job->buf = buf;
+	    job->len = len;
+	    g_async_queue_push(decode_queue, job);
+	} else
+	    g_free(buf);
     }
+    if (decompress)
+	stop_decoders(decoders);
     elapsed = g_timer_elapsed(timer, NULL);
 
     printf("Elapsed time: %.3f sec\n", elapsed);
-    printf("Objects read: %u (%.3f obj/s)\n", i, (double)i / elapsed);
-    printf("Bytes read: %llu (%.3lf bps)\n", nbytes, (double)nbytes / elapsed);
+    printf("Objects read: %u (%.3f obj/s)\n", nobjs, (double)nobjs / elapsed);
+    printf("Bytes read: %llu (%.3lf bps)\n", (unsigned long long)nbytes,
+	   (double)nbytes / elapsed);
+    printf("Read time: %.3f sec (%.3f obj/s, %.3lf bps)\n", read_busy,
+	   (double)nobjs / read_busy, (double)nbytes / read_busy);
+
+    if (decompress) {
+	gdouble decode_busy = 0;
+	guint64 npixels = 0;
+
+	for (i = 0; i < (unsigned int)ndecoders; i++) {
+	    decode_busy += decoders[i].busy;
+	    npixels += decoders[i].npixels;
+	}
+	/* decode_busy is summed over all decoders, so per-thread rates
+	 * tell how many decoders it takes to keep up with the reader */
+	printf("Decoders: %d, scale 1/%d\n", ndecoders, scale);
+	printf("Decode time: %.3f sec (%.3f obj/s, %.3f Mpixel/s per decoder)\n",
+	       decode_busy, (double)nobjs / decode_busy,
+	       (double)npixels / decode_busy / 1e6);
+	printf("Pixels decoded: %llu (%.3f Mpixel/s)\n",
+	       (unsigned long long)npixels, (double)npixels / elapsed / 1e6);
+	printf("Reader stalled on decoders: %.3f sec\n", stalled);
+	g_free(decoders);
+    }
+    g_timer_destroy(read_timer);
 
     for (i = 0; i < files->len; i++)
 	g_free(g_array_index(files, struct elem, i).file);
     g_array_free(files, TRUE);
     g_strfreev(idxfiles);
     g_free(dataroot);
+    g_free(outfile);
     g_timer_destroy(timer);
     g_option_context_free(context);
     return 0;
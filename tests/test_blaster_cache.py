@@ -0,0 +1,106 @@
+#
+#  The OpenDiamond Platform for Interactive Search
+#
+#  Copyright (c) 2019 Carnegie Mellon University
+#  All rights reserved.
+#
+#  This software is distributed under the terms of the Eclipse Public
+#  License, Version 1.0 which can be found in the file named LICENSE.
+#  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+#  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+#
+
+from builtins import str
+from hashlib import sha256
+import io
+import os
+
+import pytest
+
+# Importing the blaster package needs its optional dependencies
+pytest.importorskip('sockjs.tornado')
+from opendiamond.blaster.cache import _SearchResultLog
+
+RESULTS = [
+    ('obj1', {'a': b'value', 'b': u'caf\xe9', 'empty': b''}),
+    ('obj2', {'a': b'\0' * 100}),
+    ('obj3', {}),
+]
+
+
+def _key(name):
+    return sha256(name.encode()).hexdigest()
+
+
+def _check(log, results):
+    for name, result in results:
+        cached = log.lookup(_key(name))
+        assert set(cached) == set(result)
+        for k, v in result.items():
+            if not isinstance(v, bytes):
+                v = v.encode('utf-8')
+            assert cached[k] == v
+
+
+def _fill(path):
+    log = _SearchResultLog(path)
+    for name, result in RESULTS:
+        log.append(_key(name), result)
+    return log
+
+
+def test_result_log_reopen(tmpdir):
+    path = str(tmpdir.join('results'))
+    _check(_fill(path), RESULTS)
+    log = _SearchResultLog(path)
+    _check(log, RESULTS)
+    with pytest.raises(KeyError):
+        log.lookup(_key('obj4'))
+
+    # A later result replaces the earlier one
+    log.append(_key('obj1'), {'c': b'new'})
+    _check(_SearchResultLog(path), [('obj1', {'c': b'new'})] + RESULTS[1:])
+
+
+def test_result_log_truncated_tail(tmpdir):
+    path = str(tmpdir.join('results'))
+    _fill(path)
+    size = os.path.getsize(path)
+    with open(path, 'r+b') as fh:
+        fh.truncate(size - 10)
+
+    log = _SearchResultLog(path)
+    _check(log, RESULTS[:2])
+    with pytest.raises(KeyError):
+        log.lookup(_key('obj3'))
+    # The torn record is dropped, and later records are readable
+    assert os.path.getsize(path) < size - 10
+    log.append(_key('obj4'), {'d': b'after'})
+    _check(_SearchResultLog(path), RESULTS[:2] + [('obj4', {'d': b'after'})])
+
+
+class _FailingFile(io.FileIO):
+    '''Writes part of the first record, then fails.'''
+
+    fail = True
+
+    def write(self, data):
+        if self.fail:
+            self.fail = False
+            super(_FailingFile, self).write(bytes(data[:10]))
+            raise IOError('No space left on device')
+        return super(_FailingFile, self).write(data)
+
+
+def test_result_log_failed_append(tmpdir):
+    path = str(tmpdir.join('results'))
+    _fill(path)
+    log = _SearchResultLog(path)
+    log._fh = _FailingFile(path, 'a+')
+    with pytest.raises(IOError):
+        log.append(_key('obj4'), {'d': b'lost'})
+    log.append(_key('obj5'), {'e': b'kept'})
+
+    expected = RESULTS + [('obj5', {'e': b'kept'})]
+    _check(log, expected)
+    _check(_SearchResultLog(path), expected)
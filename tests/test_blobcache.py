@@ -11,7 +11,11 @@
 #
 
 from builtins import str
+import hashlib
 import logging
+import os
+
+import pytest
 
 import opendiamond.blobcache
 
@@ -129,3 +133,92 @@ def test_executable_blobcache(tmpdir, monkeypatch):
     # the original is changed too because iff we hardlinked
     filestat = emptyfile_path.stat()
     assert filestat.nlink == 2 and filestat.mode & 0o111
+
+
+def test_blobcache_view(tmpdir):
+    cache = opendiamond.blobcache.BlobCache(str(tmpdir))
+    sig = cache.add(b'test')
+
+    view = cache.view(sig)
+    assert isinstance(view, memoryview)
+    assert view.readonly
+    assert view.tobytes() == b'test'
+    assert cache[sig] == b'test'
+
+    emptyfile = cache.add(b'')
+    assert cache.view(emptyfile).tobytes() == b''
+
+    with pytest.raises(KeyError):
+        cache.view('0' * 64)
+
+
+def test_blobcache_view_evicts(tmpdir, monkeypatch):
+    monkeypatch.setattr(opendiamond.blobcache, 'HOT_BYTES', 10)
+    cache = opendiamond.blobcache.BlobCache(str(tmpdir))
+    first = cache.add(b'a' * 6)
+    second = cache.add(b'b' * 6)
+
+    first_view = cache.view(first)
+    assert cache.view(second).tobytes() == b'b' * 6
+    # first was evicted from the hot set, but its view is still usable
+    assert first_view.tobytes() == b'a' * 6
+    assert cache.view(first).tobytes() == b'a' * 6
+
+
+def test_blobcache_touch_interval(tmpdir, monkeypatch):
+    cache = opendiamond.blobcache.BlobCache(str(tmpdir))
+    sig = cache.add(b'test')
+    path = str(tmpdir.join(sig))
+
+    os.utime(path, (0, 0))
+    assert sig in cache
+    assert os.stat(path).st_mtime > 0
+
+    # Not touched again within TOUCH_INTERVAL
+    os.utime(path, (0, 0))
+    assert sig in cache
+    assert os.stat(path).st_mtime == 0
+
+    monkeypatch.setattr(opendiamond.blobcache, 'TOUCH_INTERVAL', 0)
+    assert sig in cache
+    assert os.stat(path).st_mtime > 0
+
+
+def test_blobcache_add_stream(tmpdir):
+    cache = opendiamond.blobcache.BlobCache(str(tmpdir))
+    expected = hashlib.sha256(b'test' * 3).hexdigest()
+
+    with cache.add_stream() as writer:
+        for _ in range(3):
+            writer.write(b'test')
+        assert writer.size == 12
+        assert writer.commit() == expected
+    assert tmpdir.listdir() == [tmpdir.join(expected)]
+    assert cache[expected] == b'test' * 3
+
+    # Expected signatures are matched case-insensitively
+    with cache.add_stream(expected.upper()) as writer:
+        writer.write(b'testtesttest')
+        assert writer.commit() == expected
+    assert len(tmpdir.listdir()) == 1
+
+
+def test_blobcache_add_stream_mismatch(tmpdir):
+    cache = opendiamond.blobcache.BlobCache(str(tmpdir))
+    expected = hashlib.sha256(b'test').hexdigest()
+
+    with cache.add_stream(expected) as writer:
+        writer.write(b'tset')
+        with pytest.raises(opendiamond.blobcache.BlobMismatchError):
+            writer.commit()
+    # The temporary file is removed and nothing is added
+    assert tmpdir.listdir() == []
+    assert expected not in cache
+
+
+def test_blobcache_add_stream_abort(tmpdir):
+    cache = opendiamond.blobcache.BlobCache(str(tmpdir))
+
+    with cache.add_stream() as writer:
+        writer.write(b'test')
+    assert tmpdir.listdir() == []
@@ -0,0 +1,44 @@
+#
+#  The OpenDiamond Platform for Interactive Search
+#
+#  Copyright (c) 2019 Carnegie Mellon University
+#  All rights reserved.
+#
+#  This software is distributed under the terms of the Eclipse Public
+#  License, Version 1.0 which can be found in the file named LICENSE.
+#  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+#  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+#
+
+import pytest
+
+import opendiamond.helpers
+
+# Lengths covering the empty input, partial blocks and several blocks
+MURMUR_LENGTHS = list(range(0, 40)) + [127, 128, 129, 4096]
+
+
+def _murmur_data(length):
+    return bytes(bytearray((i * 7 + 3) % 256 for i in range(length)))
+
+
+def test_murmur_fallback(monkeypatch):
+    monkeypatch.setattr(opendiamond.helpers, '_murmur_hexdigest', None)
+    murmur = opendiamond.helpers.murmur
+    digest = murmur(b'test')
+    assert len(digest) == 32 and digest == digest.lower()
+    assert murmur(memoryview(b'test')) == digest
+    assert murmur(b'tset') != digest
+
+
+def test_murmur_native_parity(monkeypatch):
+    native = pytest.importorskip('opendiamond._murmur')
+    monkeypatch.setattr(opendiamond.helpers, '_murmur_hexdigest', None)
+    murmur = opendiamond.helpers.murmur
+    seed = opendiamond.helpers.MURMUR_SEED
+    for length in MURMUR_LENGTHS:
+        data = _murmur_data(length)
+        expected = murmur(data)
+        assert native.hexdigest(data, seed) == expected
+        assert native.hexdigest(memoryview(data), seed) == expected
+        assert native.hexdigest(bytearray(data), seed) == expected
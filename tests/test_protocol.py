@@ -0,0 +1,68 @@
+#
+#  The OpenDiamond Platform for Interactive Search
+#
+#  Copyright (c) 2019 Carnegie Mellon University
+#  All rights reserved.
+#
+#  This software is distributed under the terms of the Eclipse Public
+#  License, Version 1.0 which can be found in the file named LICENSE.
+#  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+#  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+#
+
+import pytest
+
+import opendiamond.protocol
+from opendiamond.protocol import XDR_attribute, XDR_object
+from opendiamond.xdr import XDREncodingError
+
+# Names and values of every length modulo 4, to exercise XDR padding
+PAIRS = [
+    ('', b''),
+    ('a', b'x'),
+    ('ab', b'\0\1'),
+    ('abc', b'\xff' * 3),
+    ('nameé', bytes(bytearray(range(256)))),
+]
+
+
+@pytest.fixture
+def native_xdr():
+    module = pytest.importorskip('opendiamond._xdr')
+    assert opendiamond.protocol._xdr is module
+    return module
+
+
+def test_object_fallback_roundtrip(monkeypatch):
+    monkeypatch.setattr(opendiamond.protocol, '_xdr', None)
+    data = XDR_object([XDR_attribute(n, v) for n, v in PAIRS]).encode()
+    assert XDR_object.from_pairs(PAIRS).encode() == data
+    obj = XDR_object.decode(data)
+    assert [(a.name, a.value) for a in obj.attrs] == PAIRS
+
+
+def test_object_native_parity(monkeypatch, native_xdr):
+    native = XDR_object.from_pairs(PAIRS).encode()
+    views = [(n, memoryview(v)) for n, v in PAIRS]
+    assert XDR_object.from_pairs(views).encode() == native
+    native_attrs = [(a.name, a.value) for a in XDR_object.decode(native).attrs]
+
+    monkeypatch.setattr(opendiamond.protocol, '_xdr', None)
+    fallback = XDR_object.from_pairs(PAIRS).encode()
+    fallback_attrs = [(a.name, a.value)
+                      for a in XDR_object.decode(fallback).attrs]
+
+    assert native == fallback
+    assert native_attrs == fallback_attrs == PAIRS
+
+
+@pytest.mark.parametrize('use_native', [False, True])
+def test_object_decode_malformed(monkeypatch, use_native):
+    if use_native:
+        pytest.importorskip('opendiamond._xdr')
+    else:
+        monkeypatch.setattr(opendiamond.protocol, '_xdr', None)
+    data = XDR_object.from_pairs(PAIRS).encode()
+    for bad in (data[:-1], data[:6], data + b'\0\0\0\0'):
+        with pytest.raises((EOFError, XDREncodingError)):
+            XDR_object.decode(bad)
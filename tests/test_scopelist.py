@@ -0,0 +1,93 @@
+#
+#  The OpenDiamond Platform for Interactive Search
+#
+#  Copyright (c) 2019 Carnegie Mellon University
+#  All rights reserved.
+#
+#  This software is distributed under the terms of the Eclipse Public
+#  License, Version 1.0 which can be found in the file named LICENSE.
+#  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+#  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+#
+
+import struct
+
+import pytest
+
+from opendiamond.dataretriever.util import SCOPE_BINARY_MAGIC
+import opendiamond.server.scopelist
+
+XML_SCOPE = b'''<?xml version="1.0" encoding="UTF-8" ?>
+<objectlist count="3">
+  <count adjust="2" />
+  <object id="obj/1" src="http://example.com/1" />
+  <object src="obj/2" meta="meta/2" label="cat &amp; dog" />
+  <object id="obj/3" src="obj/3" caption="caf\xc3\xa9" empty="" />
+</objectlist>
+'''
+SCOPE_ENTRIES = [
+    ('obj/1', 'http://example.com/1', None, None),
+    (None, 'obj/2', 'meta/2', {'label': 'cat & dog'}),
+    ('obj/3', 'obj/3', None, {'caption': u'caf\xe9', 'empty': ''}),
+]
+
+
+def _record(type_, payload):
+    return struct.pack('>cI', type_, len(payload)) + payload
+
+
+def _object_record(**attrs):
+    return _record(b'O', b''.join(
+        name.encode() + b'\0' + value.encode() + b'\0'
+        for name, value in sorted(attrs.items())))
+
+
+BINARY_SCOPE = (
+    SCOPE_BINARY_MAGIC +
+    _record(b'C', struct.pack('>q', 3)) +
+    _record(b'C', struct.pack('>q', 2)) +
+    _object_record(id='obj/1', src='http://example.com/1') +
+    _object_record(src='obj/2', meta='meta/2', label='cat & dog') +
+    _object_record(id='obj/3', src='obj/3', caption=u'caf\xe9', empty='') +
+    _record(b'E', b''))
+
+
+def _fallback_parser(binary):
+    if binary:
+        return opendiamond.server.scopelist._BinaryScopeParser()
+    return opendiamond.server.scopelist._XMLScopeParser()
+
+
+def _native_parser(binary):
+    native = pytest.importorskip('opendiamond._scopelist')
+    return native.Parser(binary)
+
+
+def _parse(parser, data, chunk_size):
+    entries = []
+    for i in range(0, len(data), chunk_size):
+        entries.extend(parser.feed(data[i:i + chunk_size]))
+    parser.close()
+    return parser.count, entries
+
+
+@pytest.mark.parametrize('make_parser', [_fallback_parser, _native_parser])
+@pytest.mark.parametrize('binary,data', [(False, XML_SCOPE),
+                                         (True, BINARY_SCOPE)])
+@pytest.mark.parametrize('chunk_size', [1, 3, 7, 1 << 20])
+def test_scopelist_parse(make_parser, binary, data, chunk_size):
+    parser = make_parser(binary)
+    assert _parse(parser, data, chunk_size) == (5, SCOPE_ENTRIES)
+
+
+@pytest.mark.parametrize('make_parser', [_fallback_parser, _native_parser])
+@pytest.mark.parametrize('binary,data', [
+    (False, XML_SCOPE[:-20]),
+    (True, BINARY_SCOPE[:-5]),
+    (True, BINARY_SCOPE + b'x'),
+    (True, b'XXXX' + BINARY_SCOPE[4:]),
+])
+def test_scopelist_parse_malformed(make_parser, binary, data):
+    parser = make_parser(binary)
+    with pytest.raises(ValueError):
+        _parse(parser, data, 7)